@@ -25,6 +25,10 @@ LOCAL_SHARED_LIBRARIES := liblog libdrm libhardware libsync
 LOCAL_SRC_FILES := hwcomposer.cpp
 LOCAL_MODULE := hwcomposer.$(TARGET_BOARD_PLATFORM)
 LOCAL_CFLAGS:= -DLOG_TAG=\"hwcomposer\"
+# gralloc handles carrying a DRM format modifier (tiled/compressed buffers)
+ifeq ($(BOARD_GRALLOC_HAS_MODIFIER),true)
+LOCAL_CFLAGS += -DGRALLOC_HAS_MODIFIER
+endif
 LOCAL_MODULE_TAGS := eng
 LOCAL_C_INCLUDES += \
         $(TOP)/hardware/libhardware/modules/gralloc \
@@ -34,3 +38,5 @@ LOCAL_C_INCLUDES += \
         $(TOP)/system/core/libsync
 
 include $(BUILD_SHARED_LIBRARY)
+
+include $(call all-makefiles-under,$(LOCAL_PATH))
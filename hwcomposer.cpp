@@ -20,34 +20,103 @@
  *
  * If ro.disp.conn.external is set to "OFF" or is not defined, then the external
  * display is not enabled
+ *
+ * When several DRM devices drive displays, the connector can be prefixed by
+ * the name of the device node, otherwise the first device having a free
+ * connector of that type is used:
+ *  setprop ro.disp.conn.external card1:HDMIA
  */
 
 struct hwc_fourcc
 {
     int hwc_format;
     unsigned int fourcc;
+    unsigned int cpp;           /* bytes per pixel of the first plane */
 };
 
 static const struct hwc_fourcc to_fourcc[] = {
-    {HAL_PIXEL_FORMAT_RGBA_8888, DRM_FORMAT_ABGR8888},
-    {HAL_PIXEL_FORMAT_RGBX_8888, DRM_FORMAT_XBGR8888},
-    {HAL_PIXEL_FORMAT_BGRA_8888, DRM_FORMAT_ARGB8888},
-    {HAL_PIXEL_FORMAT_RGB_888, DRM_FORMAT_RGB888},
-    {HAL_PIXEL_FORMAT_RGB_565, DRM_FORMAT_RGB565},
-    {HAL_PIXEL_FORMAT_YV12, DRM_FORMAT_NV12},
+    {HAL_PIXEL_FORMAT_RGBA_8888, DRM_FORMAT_ABGR8888, 4},
+    {HAL_PIXEL_FORMAT_RGBX_8888, DRM_FORMAT_XBGR8888, 4},
+    {HAL_PIXEL_FORMAT_BGRA_8888, DRM_FORMAT_ARGB8888, 4},
+    {HAL_PIXEL_FORMAT_RGB_888, DRM_FORMAT_RGB888, 3},
+    {HAL_PIXEL_FORMAT_RGB_565, DRM_FORMAT_RGB565, 2},
+    {HAL_PIXEL_FORMAT_YV12, DRM_FORMAT_NV12, 1},
 };
 
-static unsigned int
-hnd_to_fourcc (private_handle_t const *hnd)
+static const struct hwc_fourcc *
+hnd_to_format (private_handle_t const *hnd)
 {
     for (unsigned int i = 0; i < ARRAY_SIZE (to_fourcc); i++)
         if (to_fourcc[i].hwc_format == hnd->format)
-            return to_fourcc[i].fourcc;
+            return &to_fourcc[i];
+
+    return NULL;
+}
+
+static unsigned int
+hnd_to_fourcc (private_handle_t const *hnd)
+{
+    const struct hwc_fourcc *fmt = hnd_to_format (hnd);
+
+    if (fmt)
+        return fmt->fourcc;
 
     ALOGI("hnd_to_fourcc can't find matching format for %ul\n", hnd->format);
     return 0;
 }
 
+/*
+ * Rows may be padded past the width (stride, in pixels), and buffers of the
+ * framebuffer heap are sub-allocations of one dma-buf at different offsets.
+ */
+static uint32_t
+hnd_to_pitch (private_handle_t const *hnd, unsigned int cpp)
+{
+    return (hnd->stride > 0 ? hnd->stride : hnd->width) * cpp;
+}
+
+static uint32_t
+hnd_to_offset (private_handle_t const *hnd)
+{
+    return hnd->offset > 0 ? hnd->offset : 0;
+}
+
+/*
+ * Tiled and compressed buffers carry their layout as a format modifier.
+ * DRM_FORMAT_MOD_INVALID means the layout is implicit (driver defined) and the
+ * framebuffer is then created without any modifier.
+ */
+static uint64_t
+hnd_to_modifier (private_handle_t const *hnd)
+{
+#ifdef GRALLOC_HAS_MODIFIER
+    return hnd->modifier;
+#else
+    return DRM_FORMAT_MOD_INVALID;
+#endif
+}
+
+/* an explicit linear layout is also what drivers without modifiers scan out */
+static bool
+is_implicit_layout (uint64_t modifier)
+{
+    return modifier == DRM_FORMAT_MOD_INVALID
+        || modifier == DRM_FORMAT_MOD_LINEAR;
+}
+
+/* HWC 1.3 and later only fill the floating point source crop */
+static hwc_rect_t
+layer_source_crop (const hwc_layer_1_t * layer)
+{
+    hwc_rect_t crop;
+
+    crop.left = (int) floorf (layer->sourceCropf.left);
+    crop.top = (int) floorf (layer->sourceCropf.top);
+    crop.right = (int) ceilf (layer->sourceCropf.right);
+    crop.bottom = (int) ceilf (layer->sourceCropf.bottom);
+    return crop;
+}
+
 #define CONN_STR_AND_INT(type) { DRM_MODE_CONNECTOR_ ## type, #type }
 
 struct hwc_connector
@@ -74,37 +143,235 @@ static const struct hwc_connector connector_list[] = {
     CONN_STR_AND_INT(eDP)
 };
 
+static int64_t
+now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime (CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * (int64_t) 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Tracing
+ *
+ * A disabled trace point only costs a load and a branch. Slices carry the
+ * frame id (the sequence number of the frame on its display) when there is
+ * one, so the SurfaceFlinger thread and the event thread can be correlated.
+ */
+static kms_trace_t hwc_trace = { 0, -1 };
+
+#define TRACE_ENABLED(cat) \
+    CC_UNLIKELY (__atomic_load_n (&hwc_trace.mask, __ATOMIC_RELAXED) & (cat))
+
+static void
+trace_write (char phase, const char *name, int64_t value)
+{
+    char buf[96];
+    int len;
+
+    if (hwc_trace.marker_fd >= 0) {
+        if (phase == 'E')
+            len = snprintf (buf, sizeof (buf), "E|%d", hwc_trace.pid);
+        else if (phase == 'C')
+            len = snprintf (buf, sizeof (buf), "C|%d|%s|%lld", hwc_trace.pid,
+                name, (long long) value);
+        else if (value >= 0)
+            len = snprintf (buf, sizeof (buf), "B|%d|%s #%lld", hwc_trace.pid,
+                name, (long long) value);
+        else
+            len = snprintf (buf, sizeof (buf), "B|%d|%s", hwc_trace.pid, name);
+        if (write (hwc_trace.marker_fd, buf, len) < 0)
+            ALOGE ("Failed to write trace marker: %s", strerror (errno));
+    }
+
+    if (hwc_trace.mask & TRACE_RING) {
+        unsigned int pos =
+            __atomic_fetch_add (&hwc_trace.ring_pos, 1, __ATOMIC_RELAXED);
+        kms_trace_event_t *ev = &hwc_trace.ring[pos % TRACE_RING_SIZE];
+
+        ev->ts = now_ns ();
+        ev->tid = gettid ();
+        ev->phase = phase;
+        strncpy (ev->name, name, sizeof (ev->name) - 1);
+        ev->value = value;
+    }
+}
+
+struct trace_scope {
+    const char *name;
+    int64_t frame;
+    bool on;
+
+    trace_scope (unsigned int cat, const char *n, int64_t f)
+        : name (n), frame (f), on (TRACE_ENABLED (cat))
+    {
+        if (on)
+            trace_write ('B', name, frame);
+    }
+
+    ~trace_scope ()
+    {
+        if (on)
+            trace_write ('E', name, frame);
+    }
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+
+/* slice from here to the end of the enclosing block, frame -1 for none */
+#define TRACE_SCOPE(cat, name, frame) \
+    trace_scope TRACE_CONCAT (trace_scope_, __LINE__) (cat, name, frame)
+
+#define TRACE_COUNTER(cat, name, value) \
+    do { \
+        if (TRACE_ENABLED (cat)) \
+            trace_write ('C', name, value); \
+    } while (0)
+
+/* read debug.hwc.trace, at startup and on each dump */
+static void
+init_trace (void)
+{
+    char prop_val[PROPERTY_VALUE_MAX];
+    unsigned int mask;
+
+    property_get ("debug.hwc.trace", prop_val, "0");
+    mask = strtoul (prop_val, NULL, 0);
+
+    if (mask && hwc_trace.marker_fd < 0) {
+        hwc_trace.pid = getpid ();
+        hwc_trace.marker_fd =
+            open ("/sys/kernel/tracing/trace_marker", O_WRONLY | O_CLOEXEC);
+        if (hwc_trace.marker_fd < 0)
+            hwc_trace.marker_fd = open ("/sys/kernel/debug/tracing/trace_marker",
+                O_WRONLY | O_CLOEXEC);
+    }
+
+    if (mask != hwc_trace.mask)
+        ALOGI ("Trace mask 0x%x%s\n", mask,
+            hwc_trace.marker_fd < 0 ? ", no trace_marker" : "");
+    __atomic_store_n (&hwc_trace.mask, mask, __ATOMIC_RELAXED);
+}
+
+static int
+dump_trace (char *buff, int buff_len)
+{
+    unsigned int end = __atomic_load_n (&hwc_trace.ring_pos, __ATOMIC_RELAXED);
+    unsigned int count = MIN (end, 32U);
+    int len = 0;
+
+    if (!(hwc_trace.mask & TRACE_RING) || buff_len <= 0)
+        return 0;
+
+    len += snprintf (buff, buff_len, "Last %u trace events:\n", count);
+    for (unsigned int i = end - count; i != end && len < buff_len; i++) {
+        kms_trace_event_t *ev = &hwc_trace.ring[i % TRACE_RING_SIZE];
+
+        len += snprintf (buff + len, buff_len - len,
+            "  %lld.%06lld %5d %c %s %lld\n",
+            (long long) ev->ts / 1000000000,
+            (long long) ev->ts % 1000000000 / 1000, ev->tid, ev->phase,
+            ev->name, (long long) ev->value);
+    }
+
+    return MIN (len, buff_len);
+}
+
 static int
 send_vsync_request (hwc_context_t * ctx, int disp)
 {
+    kms_display_t *kdisp = &ctx->displays[disp];
     int ret = 0;
 
     drmVBlank vbl;
 
-    if (disp == HWC_DISPLAY_PRIMARY)
+    if (!kdisp->dev)
+        return -ENODEV;
+
+    /* vblanks are requested by crtc index on the device of the display */
+    if (kdisp->pipe == 0)
 	vbl.request.type =
 	    (drmVBlankSeqType) (DRM_VBLANK_RELATIVE | DRM_VBLANK_EVENT);
-    else
+    else if (kdisp->pipe == 1)
         vbl.request.type =
             (drmVBlankSeqType) (DRM_VBLANK_RELATIVE | DRM_VBLANK_EVENT | DRM_VBLANK_SECONDARY);
+    else
+        vbl.request.type =
+            (drmVBlankSeqType) (DRM_VBLANK_RELATIVE | DRM_VBLANK_EVENT |
+            ((kdisp->pipe << DRM_VBLANK_HIGH_CRTC_SHIFT) &
+                DRM_VBLANK_HIGH_CRTC_MASK));
 
     vbl.request.sequence = 1;
-    vbl.request.signal = (unsigned long) &ctx->displays[disp];
+    vbl.request.signal = (unsigned long) kdisp;
 
-    ret = drmWaitVBlank (ctx->drm_fd, &vbl);
+    {
+        TRACE_SCOPE (TRACE_KMS, "drmWaitVBlank", -1);
+        ret = drmWaitVBlank (kdisp->dev->fd, &vbl);
+    }
     if (ret < 0)
         ALOGE ("Failed to request vsync %d", errno);
+    ctx->displays[disp].vblank_armed = ret == 0;
 
     return ret;
 }
 
-static void signal_fences (hwc_context_t * ctx, int disp)
+static unsigned int queue_length (kms_display_t * kdisp);
+
+/*
+ * Vblank events only run while something needs them: SurfaceFlinger vsync,
+ * a frame to latch or waiting for its flip, or the power on measurement. An
+ * idle display without vsync lets the CPU sleep; hwc_eventControl() and
+ * queued frames wake the event thread, which arms them again.
+ */
+static bool
+vblank_wanted (kms_display_t * kdisp)
+{
+    if (kdisp->power_mode != HWC_POWER_MODE_NORMAL
+        && kdisp->power_mode != HWC_POWER_MODE_DOZE)
+        return false;
+
+    return HWC_LOAD (&kdisp->vsync_on) || kdisp->pending_seq
+        || queue_length (kdisp) || kdisp->power_on_ns;
+}
+
+static int64_t
+mode_vsync_period (drmModeModeInfoPtr mode)
+{
+    if (mode->htotal && mode->vtotal && mode->clock)
+        return (int64_t) mode->htotal * mode->vtotal * 1000000 / mode->clock;
+    if (mode->vrefresh)
+        return 1000000000 / mode->vrefresh;
+    return 1000000000 / 60;
+}
+
+static void signal_fences (hwc_context_t * ctx, int disp, unsigned seq)
 {
      kms_display_t *kdisp = &ctx->displays[disp];
+     TRACE_SCOPE (TRACE_FENCE, "signal_fences", seq);
+
+     /* advance the timeline up to the frame now on screen */
+     if ((int) (seq - kdisp->signaled_fences) > 0) {
+         sw_sync_timeline_inc(kdisp->timeline, seq - kdisp->signaled_fences);
+         kdisp->signaled_fences = seq;
+     }
+}
 
-     /* signal timeline point */
-     sw_sync_timeline_inc(kdisp->timeline, 1);
-     kdisp->signaled_fences++;
+/* the last commit reached the screen at ts */
+static void
+frame_shown (kms_display_t * kdisp, int disp, int64_t ts)
+{
+    HWC_STORE (&kdisp->shown_seq, kdisp->pending_seq);
+    signal_fences (kdisp->ctx, disp, kdisp->pending_seq);
+    kdisp->pending_seq = 0;
+
+    if (!kdisp->ctx->first_frame_ns) {
+        HWC_STORE (&kdisp->ctx->first_frame_ns, ts - kdisp->ctx->open_ns);
+        ALOGI ("First frame on screen %lld us after open (probe %lld us)\n",
+            (long long) (ts - kdisp->ctx->open_ns) / 1000,
+            (long long) kdisp->ctx->probe_ns / 1000);
+    }
 }
 
 static void
@@ -112,133 +379,517 @@ vblank_handler (int fd, unsigned int frame, unsigned int sec,
     unsigned int usec, void *data)
 {
     kms_display_t *kdisp = (kms_display_t *) data;
-    const hwc_procs_t *procs = kdisp->ctx->cb_procs;
+    const hwc_procs_t *procs = HWC_LOAD (&kdisp->ctx->cb_procs);
     int disp = &kdisp->ctx->displays[HWC_DISPLAY_PRIMARY] == kdisp ? HWC_DISPLAY_PRIMARY : HWC_DISPLAY_EXTERNAL;
+    int64_t ts = sec * (int64_t) 1000000000 + usec * (int64_t) 1000;
+    TRACE_SCOPE (TRACE_VBLANK, disp ? "vblank ext" : "vblank", frame);
+
+    kdisp->last_vblank_ns = ts;
+    kdisp->vblank_armed = false;
+
+    /* a commit without page flip is on screen from the next vblank */
+    if (kdisp->pending_seq && !kdisp->flip_pending
+        && ts >= kdisp->pending_commit_ns)
+        frame_shown (kdisp, disp, ts);
+
+    if (kdisp->power_on_ns) {
+        HWC_STORE (&kdisp->screen_on_ns, ts - kdisp->power_on_ns);
+        ALOGI ("Display %d on in %lld us\n", disp,
+            (long long) (ts - kdisp->power_on_ns) / 1000);
+        kdisp->power_on_ns = 0;
+    }
 
-    signal_fences (kdisp->ctx, disp);
+    if (procs && HWC_LOAD (&kdisp->vsync_on))
+        procs->vsync (procs, disp, ts);
+
+    /* request next VSYNC, vblanks stop when nothing waits for them */
+    if (vblank_wanted (kdisp))
+        send_vsync_request (kdisp->ctx, disp);
+}
 
-    if (kdisp->vsync_on) {
-        int64_t ts = sec * (int64_t) 1000000000 + usec * (int64_t) 1000;
+static void update_latch_margin (hwc_context_t * ctx, kms_display_t * kdisp,
+    int64_t duration, bool missed);
 
-        procs->vsync (procs, disp, ts);
+/* the page flip of the last commit completed on the vblank at ts */
+static void
+page_flip_handler (int fd, unsigned int frame, unsigned int sec,
+    unsigned int usec, void *data)
+{
+    kms_display_t *kdisp = (kms_display_t *) data;
+    hwc_context_t *ctx = kdisp->ctx;
+    int disp = &ctx->displays[HWC_DISPLAY_PRIMARY] == kdisp ?
+        HWC_DISPLAY_PRIMARY : HWC_DISPLAY_EXTERNAL;
+    int64_t ts = sec * (int64_t) 1000000000 + usec * (int64_t) 1000;
+    TRACE_SCOPE (TRACE_VBLANK, disp ? "flip ext" : "flip", frame);
+
+    if (!kdisp->flip_pending)
+        return;
+    kdisp->flip_pending = false;
+
+    /* the flip missed its vblank when it landed on a later one */
+    if (ctx->latch_margin_ns)
+        update_latch_margin (ctx, kdisp, kdisp->pending_duration_ns,
+            ts > kdisp->pending_target_ns + kdisp->vsync_period_ns / 2);
+
+    if (kdisp->pending_seq)
+        frame_shown (kdisp, disp, ts);
+}
+
+static uint32_t
+get_prop_id (int drm_fd, uint32_t obj_id, uint32_t obj_type, const char *name,
+    uint64_t * value)
+{
+    drmModeObjectPropertiesPtr properties;
+    uint32_t prop_id = 0;
+
+    properties = drmModeObjectGetProperties (drm_fd, obj_id, obj_type);
+    if (!properties)
+        return 0;
+
+    for (uint32_t i = 0; i < properties->count_props && !prop_id; i++) {
+        drmModePropertyPtr property =
+            drmModeGetProperty (drm_fd, properties->props[i]);
+
+        if (!property)
+            continue;
+        if (strcmp (property->name, name) == 0) {
+            prop_id = property->prop_id;
+            if (value)
+                *value = properties->prop_values[i];
+        }
+        drmModeFreeProperty (property);
     }
 
-    /* request next VSYNC */
-    send_vsync_request (kdisp->ctx, disp);
+    drmModeFreeObjectProperties (properties);
+    return prop_id;
 }
 
-static int
-init_display (hwc_context_t * ctx, int disp, uint32_t connector_type)
+/* slowest mode with the same resolution, used while the display is idle */
+static drmModeModeInfoPtr
+find_idle_mode (drmModeConnectorPtr connector, drmModeModeInfoPtr mode)
+{
+    drmModeModeInfoPtr idle = NULL;
+
+    for (int i = 0; i < connector->count_modes; i++) {
+        drmModeModeInfoPtr m = &connector->modes[i];
+
+        if (m->hdisplay != mode->hdisplay || m->vdisplay != mode->vdisplay)
+            continue;
+        if ((m->flags ^ mode->flags) & DRM_MODE_FLAG_INTERLACE)
+            continue;
+        if (mode_vsync_period (m) <= mode_vsync_period (idle ? idle : mode))
+            continue;
+        idle = m;
+    }
+
+    return idle;
+}
+
+static void
+init_idle (hwc_context_t * ctx, int disp)
+{
+    kms_display_t *d = &ctx->displays[disp];
+    uint64_t vrr_capable = 0;
+
+    d->idle = false;
+    d->idle_mode = NULL;
+    d->vrr_prop_id = 0;
+
+    if (get_prop_id (d->dev->fd, d->con->connector_id,
+            DRM_MODE_OBJECT_CONNECTOR, "vrr_capable", &vrr_capable)
+        && vrr_capable)
+        d->vrr_prop_id = get_prop_id (d->dev->fd, d->crtc_id,
+            DRM_MODE_OBJECT_CRTC, "VRR_ENABLED", NULL);
+
+    if (!d->vrr_prop_id && ctx->idle_modeset)
+        d->idle_mode = find_idle_mode (d->con, d->mode);
+
+    if (d->vrr_prop_id)
+        ALOGI ("Display %d: variable refresh rate when idle\n", disp);
+    else if (d->idle_mode)
+        ALOGI ("Display %d: %s@%d when idle\n", disp, d->idle_mode->name,
+            d->idle_mode->vrefresh);
+}
+
+static void
+init_color (hwc_context_t * ctx, int disp)
 {
     kms_display_t *d = &ctx->displays[disp];
+    int drm_fd = d->dev->fd;
+    uint64_t size = 0;
+
+    d->ctm_prop_id = get_prop_id (drm_fd, d->crtc_id, DRM_MODE_OBJECT_CRTC,
+        "CTM", NULL);
+
+    d->degamma_prop_id = 0;
+    if (get_prop_id (drm_fd, d->crtc_id, DRM_MODE_OBJECT_CRTC,
+            "DEGAMMA_LUT_SIZE", &size) && size) {
+        d->degamma_size = size;
+        d->degamma_prop_id = get_prop_id (drm_fd, d->crtc_id,
+            DRM_MODE_OBJECT_CRTC, "DEGAMMA_LUT", NULL);
+    }
+
+    d->gamma_prop_id = 0;
+    if (get_prop_id (drm_fd, d->crtc_id, DRM_MODE_OBJECT_CRTC,
+            "GAMMA_LUT_SIZE", &size) && size) {
+        d->gamma_size = size;
+        d->gamma_prop_id = get_prop_id (drm_fd, d->crtc_id,
+            DRM_MODE_OBJECT_CRTC, "GAMMA_LUT", NULL);
+    }
+
+    if (d->ctm_prop_id || d->degamma_prop_id || d->gamma_prop_id)
+        ALOGI ("Display %d: color pipeline%s%s%s\n", disp,
+            d->degamma_prop_id ? " DEGAMMA_LUT" : "",
+            d->ctm_prop_id ? " CTM" : "", d->gamma_prop_id ? " GAMMA_LUT" : "");
+}
+
+/*
+ * Device discovery
+ *
+ * The /dev/dri/card* nodes are probed in parallel, each probe fetching the
+ * whole KMS state of its node into a snapshot. Every node able to scan out
+ * dumb buffers is kept, the ones with the most connected outputs first so
+ * displays which don't name a device land on them. drmOpen() by driver name
+ * is only the fallback when no node is usable.
+ */
+typedef struct kms_probe {
+    char path[32];
+    int fd;
+    int connected;
+    kms_snapshot_t snap;
+    pthread_t thread;
+    bool thread_started;
+} kms_probe_t;
+
+static void
+free_snapshot (kms_snapshot_t * snap)
+{
+    if (!snap->res)
+        return;
+
+    for (int i = 0; i < snap->res->count_connectors; i++)
+        if (snap->connectors[i])
+            drmModeFreeConnector (snap->connectors[i]);
+    for (int i = 0; i < snap->res->count_encoders; i++)
+        if (snap->encoders[i])
+            drmModeFreeEncoder (snap->encoders[i]);
+    for (int i = 0; i < snap->res->count_crtcs; i++)
+        if (snap->crtcs[i])
+            drmModeFreeCrtc (snap->crtcs[i]);
+
+    free (snap->connectors);
+    free (snap->encoders);
+    free (snap->crtcs);
+    drmModeFreeResources (snap->res);
+    memset (snap, 0, sizeof (*snap));
+}
+
+static int
+fetch_snapshot (int drm_fd, kms_snapshot_t * snap)
+{
+    drmModeResPtr res;
+
+    res = drmModeGetResources (drm_fd);
+    if (!res)
+        return -errno;
+
+    snap->res = res;
+    snap->connectors = (drmModeConnectorPtr *)
+        calloc (res->count_connectors + 1, sizeof (drmModeConnectorPtr));
+    snap->encoders = (drmModeEncoderPtr *)
+        calloc (res->count_encoders + 1, sizeof (drmModeEncoderPtr));
+    snap->crtcs = (drmModeCrtcPtr *)
+        calloc (res->count_crtcs + 1, sizeof (drmModeCrtcPtr));
+    if (!snap->connectors || !snap->encoders || !snap->crtcs) {
+        free_snapshot (snap);
+        return -ENOMEM;
+    }
+
+    for (int i = 0; i < res->count_connectors; i++)
+        snap->connectors[i] = drmModeGetConnector (drm_fd, res->connectors[i]);
+    for (int i = 0; i < res->count_encoders; i++)
+        snap->encoders[i] = drmModeGetEncoder (drm_fd, res->encoders[i]);
+    for (int i = 0; i < res->count_crtcs; i++)
+        snap->crtcs[i] = drmModeGetCrtc (drm_fd, res->crtcs[i]);
+
+    return 0;
+}
+
+static drmModeEncoderPtr
+snapshot_encoder (kms_snapshot_t * snap, uint32_t encoder_id)
+{
+    for (int i = 0; i < snap->res->count_encoders; i++)
+        if (snap->encoders[i] && snap->encoders[i]->encoder_id == encoder_id)
+            return snap->encoders[i];
+    return NULL;
+}
+
+static void *
+probe_drm_node (void *arg)
+{
+    kms_probe_t *probe = (kms_probe_t *) arg;
+    uint64_t cap = 0;
+
+    probe->connected = -1;
+
+    probe->fd = open (probe->path, O_RDWR | O_CLOEXEC);
+    if (probe->fd < 0)
+        return NULL;
+
+    /* render-only or non modesetting devices can't drive a display */
+    if (drmGetCap (probe->fd, DRM_CAP_DUMB_BUFFER, &cap) || !cap)
+        return NULL;
+
+    if (fetch_snapshot (probe->fd, &probe->snap))
+        return NULL;
+
+    if (!probe->snap.res->count_crtcs)
+        return NULL;
+
+    probe->connected = 0;
+    for (int i = 0; i < probe->snap.res->count_connectors; i++) {
+        drmModeConnectorPtr con = probe->snap.connectors[i];
+
+        if (con && con->connection == DRM_MODE_CONNECTED)
+            probe->connected++;
+    }
+
+    return NULL;
+}
+
+static int
+open_drm_legacy (void)
+{
     const char *modules[] = {
 	"i915", "radeon", "nouveau", "vmwgfx", "omapdrm", "exynos",
         "tilcdc", "msm", "sti", "hisi"
     };
-    int drm_fd, i;
-    drmModeResPtr resources;
-    drmModeConnector *connector = NULL;
-    drmModeEncoder *encoder;
-    drmModeModeInfoPtr mode;
-    uint32_t possible_crtcs;
-    private_module_t *m = NULL;
+    int drm_fd = -1;
 
-    /* open drm only once for all the displays */
-    if (ctx->drm_fd < 0) {
-        /* Open DRM device */
-        for (unsigned int i = 0; i < ARRAY_SIZE (modules); i++) {
-            drm_fd = drmOpen (modules[i], NULL);
-            if (drm_fd >= 0) {
-                ALOGI ("Open %s drm device (%d)\n", modules[i], drm_fd);
-                break;
-            }
+    for (unsigned int i = 0; i < ARRAY_SIZE (modules); i++) {
+        drm_fd = drmOpen (modules[i], NULL);
+        if (drm_fd >= 0) {
+            ALOGI ("Open %s drm device (%d)\n", modules[i], drm_fd);
+            break;
         }
-        if (drm_fd < 0) {
-            ALOGE ("Failed to open DRM: %s\n", strerror (errno));
-            return -EINVAL;
+    }
+
+    return drm_fd;
+}
+
+static int
+open_drm_devices (hwc_context_t * ctx)
+{
+    kms_probe_t probes[MAX_DRM_NODES];
+    int count = 0;
+    struct dirent *entry;
+    DIR *dir;
+
+    memset (probes, 0, sizeof (probes));
+
+    dir = opendir ("/dev/dri");
+    while (dir && (entry = readdir (dir)) && count < MAX_DRM_NODES) {
+        kms_probe_t *probe = &probes[count];
+
+        if (strncmp (entry->d_name, "card", 4))
+            continue;
+
+        snprintf (probe->path, sizeof (probe->path), "/dev/dri/%s",
+            entry->d_name);
+        probe->fd = -1;
+        if (pthread_create (&probe->thread, NULL, probe_drm_node, probe))
+            probe_drm_node (probe);
+        else
+            probe->thread_started = true;
+        count++;
+    }
+    if (dir)
+        closedir (dir);
+
+    for (int i = 0; i < count; i++)
+        if (probes[i].thread_started)
+            pthread_join (probes[i].thread, NULL);
+
+    while (ctx->num_devices < MAX_DRM_NODES) {
+        kms_device_t *dev = &ctx->devices[ctx->num_devices];
+        int best = -1;
+
+        for (int i = 0; i < count; i++) {
+            if (probes[i].connected < 0)
+                continue;
+            if (best < 0 || probes[i].connected > probes[best].connected
+                || (probes[i].connected == probes[best].connected
+                    && strcmp (probes[i].path, probes[best].path) < 0))
+                best = i;
         }
+        if (best < 0)
+            break;
 
-        ctx->drm_fd = drm_fd;
-    } else {
-        drm_fd = ctx->drm_fd;
+        ALOGI ("Open %s drm device (%d), %d connected output(s)\n",
+            probes[best].path, probes[best].fd, probes[best].connected);
+        strcpy (dev->path, probes[best].path);
+        dev->fd = probes[best].fd;
+        dev->snap = probes[best].snap;
+        ctx->num_devices++;
+
+        probes[best].fd = -1;
+        probes[best].connected = -1;
+        memset (&probes[best].snap, 0, sizeof (probes[best].snap));
     }
 
-    resources = drmModeGetResources (drm_fd);
-    if (!resources) {
-        ALOGE ("Failed to get resources: %s\n", strerror (errno));
-        goto close;
+    for (int i = 0; i < count; i++) {
+        free_snapshot (&probes[i].snap);
+        if (probes[i].fd >= 0)
+            close (probes[i].fd);
     }
 
-    if (connector_type == DRM_MODE_CONNECTOR_Unknown) {
-        if (disp < resources->count_connectors)
-            connector = drmModeGetConnector (drm_fd, resources->connectors[disp]);
-    } else {
-        for (i = 0; i < resources->count_connectors; i++) {
-            connector = drmModeGetConnector (drm_fd, resources->connectors[i]);
-            if (connector->connector_type == connector_type)
-                break;
-            drmModeFreeConnector (connector);
-            connector = NULL;
-        }
+    if (ctx->num_devices)
+        return 0;
+
+    ctx->devices[0].fd = open_drm_legacy ();
+    if (ctx->devices[0].fd < 0) {
+        ALOGE ("Failed to open DRM: %s\n", strerror (errno));
+        return -EINVAL;
+    }
+    ctx->num_devices = 1;
+    strcpy (ctx->devices[0].path, "drm");
+
+    return fetch_snapshot (ctx->devices[0].fd, &ctx->devices[0].snap);
+}
+
+/* first connector of the given type not taken by another display */
+static drmModeConnectorPtr
+find_connector (hwc_context_t * ctx, kms_device_t * dev,
+    uint32_t connector_type)
+{
+    kms_snapshot_t *snap = &dev->snap;
+
+    for (int i = 0; i < snap->res->count_connectors; i++) {
+        drmModeConnectorPtr con = snap->connectors[i];
+        bool used = false;
+
+        if (!con)
+            continue;
+        if (connector_type != DRM_MODE_CONNECTOR_Unknown
+            && con->connector_type != connector_type)
+            continue;
+
+        for (int disp = 0; disp < HWC_NUM_DISPLAY_TYPES; disp++)
+            used |= ctx->displays[disp].con == con;
+        if (!used)
+            return con;
+    }
+
+    return NULL;
+}
+
+/*
+ * Bind a display to a connector of the given device, or of the first device
+ * having one of the wanted type when dev is NULL, and to a free crtc.
+ */
+static int
+init_display (hwc_context_t * ctx, int disp, kms_device_t * dev,
+    uint32_t connector_type)
+{
+    kms_display_t *d = &ctx->displays[disp];
+    drmModeConnector *connector = NULL;
+    drmModeEncoder *encoder;
+    drmModeModeInfoPtr mode;
+    int pipe;
+
+    for (unsigned int i = 0; i < ctx->num_devices && !connector; i++) {
+        if (dev && dev != &ctx->devices[i])
+            continue;
+        connector = find_connector (ctx, &ctx->devices[i], connector_type);
+        if (connector)
+            dev = &ctx->devices[i];
     }
 
-    if (!connector) {
+    if (!connector || !connector->count_modes) {
         ALOGE ("No connector %d (display %d)\n", connector_type, disp);
-        goto free_ressources;
+        return -1;
     }
 
     mode = &connector->modes[0];
-    ALOGI ("Display %d: %dx%d, type=%s\n", disp, mode->hdisplay, mode->vdisplay,
-            connector_list[connector->connector_type].name);
+    ALOGI ("Display %d: %dx%d, type=%s on %s\n", disp, mode->hdisplay,
+            mode->vdisplay, connector_list[connector->connector_type].name,
+            dev->path);
 
-    encoder = drmModeGetEncoder (drm_fd, connector->encoders[0]);
+    encoder = connector->count_encoders ?
+        snapshot_encoder (&dev->snap, connector->encoders[0]) : NULL;
     if (!encoder) {
         ALOGE ("Failed to get encoder\n");
-        goto free_connector;
+        return -1;
     }
 
-    if (!(encoder->possible_crtcs & (1 << disp)))
-        goto free_encoder;
+    for (pipe = 0; pipe < dev->snap.res->count_crtcs; pipe++)
+        if ((encoder->possible_crtcs & (1 << pipe))
+            && !(dev->used_crtcs & (1 << pipe)))
+            break;
+    if (pipe == dev->snap.res->count_crtcs) {
+        ALOGE ("No crtc left for display %d\n", disp);
+        return -1;
+    }
+    dev->used_crtcs |= 1 << pipe;
 
+    d->dev = dev;
+    d->pipe = pipe;
     d->con = connector;
     d->enc = encoder;
-    d->crtc_id = resources->crtcs[disp];
+    d->crtc_id = dev->snap.res->crtcs[pipe];
+    d->crtc = dev->snap.crtcs[pipe];
     d->mode = mode;
+    d->width = mode->hdisplay;
+    d->height = mode->vdisplay;
+    d->render_scale = d->render_scale_next = d->render_scale_saved = 100;
     d->evctx.version = DRM_EVENT_CONTEXT_VERSION;
     d->evctx.vblank_handler = vblank_handler;
+    d->evctx.page_flip_handler = page_flip_handler;
     d->ctx = ctx;
 
-    drmModeFreeResources (resources);
-
     /* sync init */
     d->timeline = sw_sync_timeline_create();
+    d->cache_timeline = sw_sync_timeline_create();
     d->signaled_fences = 0;
+    d->shown_seq = 0;
+    d->frame_seq = 0;
     d->vsync_on = 0;
 
-    return 0;
+    d->vsync_period_ns = mode_vsync_period (mode);
+    d->latch_margin_ns = ctx->latch_margin_ns;
+
+    init_idle (ctx, disp);
+    init_color (ctx, disp);
+
+    d->power_mode = HWC_POWER_MODE_NORMAL;
+    d->dpms_prop_id = get_prop_id (dev->fd, connector->connector_id,
+        DRM_MODE_OBJECT_CONNECTOR, "DPMS", NULL);
 
-free_encoder:
-    drmModeFreeEncoder (encoder);
-free_connector:
-    drmModeFreeConnector (connector);
-free_ressources:
-    drmModeFreeResources (resources);
-close:
-    return -1;
+    return 0;
 }
 
+static void destroy_static_cache (int drm_fd, kms_static_cache_t * cache);
+static void destroy_dumb (int drm_fd, kms_dumb_t * dumb);
+
 static void
-destroy_display (int drm_fd, kms_display_t * d)
+destroy_display (kms_display_t * d)
 {
-    if (d->crtc)
-        drmModeFreeCrtc (d->crtc);
-    if (d->enc)
-        drmModeFreeEncoder (d->enc);
-    if (d->con)
-        drmModeFreeConnector (d->con);
-    memset (d, 0, sizeof (*d));
+    /* connector, encoder and crtc belong to the snapshot */
+    if (d->dev) {
+        destroy_static_cache (d->dev->fd, &d->cache);
+        destroy_dumb (d->dev->fd, &d->modeset_fb);
+        for (int i = 0; i < 3; i++)
+            if (d->color_blobs[i])
+                drmModeDestroyPropertyBlob (d->dev->fd, d->color_blobs[i]);
+    }
 
-    close(d->timeline);
+    /* the timeline is created along with the ctx back pointer */
+    if (d->ctx && d->timeline >= 0)
+        close (d->timeline);
+    if (d->ctx && d->cache_timeline >= 0)
+        close (d->cache_timeline);
+
+    memset (d, 0, sizeof (*d));
 }
 
 static void
@@ -246,30 +897,2237 @@ dump_layer (hwc_layer_1_t * l)
 {
     ALOGI
         ("Layer type=%d, flags=0x%08x, handle=0x%p, tr=0x%02x, blend=0x%04x,"
-        " {%d,%d,%d,%d} -> {%d,%d,%d,%d}, acquireFd=%d, releaseFd=%d",
+        " {%.1f,%.1f,%.1f,%.1f} -> {%d,%d,%d,%d}, acquireFd=%d, releaseFd=%d",
         l->compositionType, l->flags, l->handle, l->transform, l->blending,
-        l->sourceCrop.left, l->sourceCrop.top, l->sourceCrop.right,
-        l->sourceCrop.bottom, l->displayFrame.left, l->displayFrame.top,
+        l->sourceCropf.left, l->sourceCropf.top, l->sourceCropf.right,
+        l->sourceCropf.bottom, l->displayFrame.left, l->displayFrame.top,
         l->displayFrame.right, l->displayFrame.bottom, l->acquireFenceFd,
         l->releaseFenceFd);
 }
 
-static void *
-event_handler (void *arg)
+static bool
+is_display_connected (hwc_context_t * ctx, int disp)
 {
-    hwc_context_t *ctx = (hwc_context_t *) arg;
-    pthread_mutex_t *mutex = &ctx->ctx_mutex;
-    int drm_fd = ctx->drm_fd;
-    drmEventContext evctx = {
+    if ((disp != HWC_DISPLAY_PRIMARY) && (disp != HWC_DISPLAY_EXTERNAL))
+        return false;
+
+    if (!ctx->displays[disp].con)
+        return false;
+
+    if (ctx->displays[disp].con->connection == DRM_MODE_CONNECTED)
+        return true;
+
+    return false;
+}
+
+static bool
+set_zorder (kms_device_t * dev, int plane_id, int zorder)
+{
+    drmModeObjectPropertiesPtr properties = NULL;
+    drmModePropertyPtr property = NULL;
+    int i, ret;
+
+    properties =
+        drmModeObjectGetProperties (dev->fd, plane_id,
+        DRM_MODE_OBJECT_PLANE);
+
+    if (!properties)
+        return false;
+
+    for (i = 0; i < (int) properties->count_props; ++i) {
+        property = drmModeGetProperty (dev->fd, properties->props[i]);
+        if (!property)
+            continue;
+        if (strcmp (property->name, "zpos") == 0)
+            break;
+        drmModeFreeProperty (property);
+    }
+
+    if (i == (int) properties->count_props)
+        goto free_properties;
+
+    ret =
+        drmModeObjectSetProperty (dev->fd, plane_id,
+        DRM_MODE_OBJECT_PLANE, property->prop_id, zorder);
+    drmModeFreeProperty (property);
+
+free_properties:
+    drmModeFreeObjectProperties (properties);
+    return ! !ret;
+}
+
+/*
+ * The timeline of a display counts the frames which reached the screen: the
+ * retire fence of a frame signals once it is displayed, the release fence of
+ * its buffers once a newer frame replaced it.
+ */
+static void set_release_fences (hwc_context_t * ctx, int disp,
+    hwc_display_contents_1_t * display, unsigned seq)
+{
+    kms_display_t *kdisp = &ctx->displays[disp];
+    hwc_layer_1_t *last = NULL;
+    int fence;
+
+    /* the client target stays queued or on screen like the overlays */
+    for (size_t i = 0; i < display->numHwLayers; i++)
+        if (display->hwLayers[i].compositionType == HWC_OVERLAY
+            || display->hwLayers[i].compositionType == HWC_FRAMEBUFFER_TARGET)
+            last = &display->hwLayers[i];
+
+    /* SurfaceFlinger owns one fd per layer: the frame fence goes to the last
+     * scanned out layer, the others get a dup of it */
+    if (last) {
+        fence = sw_sync_fence_create(kdisp->timeline, "hwc_release", seq + 1);
+
+        for (size_t i = 0; i < display->numHwLayers; i++) {
+            hwc_layer_1_t *target = &display->hwLayers[i];
+            if ((target->compositionType == HWC_OVERLAY
+                    || target->compositionType == HWC_FRAMEBUFFER_TARGET)
+                && target != last)
+                target->releaseFenceFd = fence >= 0 ? dup (fence) : -1;
+        }
+        last->releaseFenceFd = fence;
+    }
+
+    display->retireFenceFd =
+        sw_sync_fence_create(kdisp->timeline, "hwc_retire", seq);
+}
+
+/*
+ * Buffer import
+ *
+ * Any gralloc buffer exported as a dma-buf can be scanned out, whatever the
+ * heap it comes from (ION, system heap, udmabuf on top of a memfd, ...):
+ * the dma-buf is turned into a GEM handle through PRIME and the framebuffer
+ * layout is derived from the buffer format. A buffer shown on displays of
+ * different devices is imported into each of them.
+ *
+ * PRIME hands back the same GEM handle each time a dma-buf is imported on a
+ * device, and the handle keeps the dma-buf alive until it is closed. The
+ * handles are refcounted by the framebuffers using them and closed with the
+ * last one.
+ */
+static kms_gem_t *
+find_gem (kms_device_t * dev, uint32_t handle)
+{
+    for (unsigned int i = 0; i < MAX_CACHED_FBS; i++)
+        if (dev->gems[i].refs && dev->gems[i].handle == handle)
+            return &dev->gems[i];
+    return NULL;
+}
+
+static void
+close_gem (kms_device_t * dev, uint32_t handle)
+{
+    struct drm_gem_close req;
+
+    /* gralloc may hold the same handle on a shared fd */
+    if (dev->shared_handles)
+        return;
+
+    memset (&req, 0, sizeof (req));
+    req.handle = handle;
+    if (drmIoctl (dev->fd, DRM_IOCTL_GEM_CLOSE, &req))
+        ALOGE ("Failed to close GEM handle %u: %s", handle, strerror (errno));
+}
+
+static int
+ref_gem (kms_device_t * dev, uint32_t handle)
+{
+    kms_gem_t *gem = find_gem (dev, handle);
+
+    if (gem) {
+        gem->refs++;
+        return 0;
+    }
+
+    for (unsigned int i = 0; i < MAX_CACHED_FBS && !gem; i++)
+        if (!dev->gems[i].refs)
+            gem = &dev->gems[i];
+    if (!gem)
+        return -ENOSPC;
+
+    gem->handle = handle;
+    gem->refs = 1;
+    dev->num_gems++;
+    dev->gems_opened++;
+    return 0;
+}
+
+static void
+unref_gem (kms_device_t * dev, uint32_t handle)
+{
+    kms_gem_t *gem = find_gem (dev, handle);
+
+    if (!gem || --gem->refs)
+        return;
+
+    close_gem (dev, handle);
+    dev->num_gems--;
+    dev->gems_closed++;
+}
+
+static kms_fb_t *
+find_fb (kms_device_t * dev, private_handle_t const *hnd, ino_t ino)
+{
+    const struct hwc_fourcc *fmt = hnd_to_format (hnd);
+
+    for (unsigned int i = 0; i < MAX_CACHED_FBS; i++) {
+        kms_fb_t *kfb = &dev->fbs[i];
+
+        if (kfb->ino == ino && kfb->fourcc == fmt->fourcc
+            && kfb->width == (uint32_t) hnd->width
+            && kfb->height == (uint32_t) hnd->height
+            && kfb->offset == hnd_to_offset (hnd)
+            && kfb->modifier == hnd_to_modifier (hnd))
+            return kfb;
+    }
+    return NULL;
+}
+
+static int
+import_buffer (kms_device_t * dev, private_handle_t const *hnd, kms_fb_t * kfb)
+{
+    const struct hwc_fourcc *fmt = hnd_to_format (hnd);
+    uint32_t bo[4] = { 0 };
+    uint32_t pitch[4] = { 0 };
+    uint32_t offset[4] = { 0 };
+    uint32_t width, height;
+    uint64_t modifier;
+    int ret;
+    TRACE_SCOPE (TRACE_IMPORT, "import_buffer", -1);
+
+    if (!fmt)
+        return -EINVAL;
+
+    width = hnd->width;
+    height = hnd->height;
+
+    ret = drmPrimeFDToHandle (dev->fd, hnd->share_fd, &bo[0]);
+    if (ret) {
+        ALOGE ("Failed to import dma-buf %d: %s", hnd->share_fd,
+            strerror (errno));
+        return ret;
+    }
+
+    if (ref_gem (dev, bo[0])) {
+        ALOGE ("Too many GEM handles on %s", dev->path);
+        if (!find_gem (dev, bo[0]))
+            close_gem (dev, bo[0]);
+        return -ENOSPC;
+    }
+
+    pitch[0] = hnd_to_pitch (hnd, fmt->cpp);
+    offset[0] = hnd_to_offset (hnd);
+    if (fmt->fourcc == DRM_FORMAT_NV12) {
+        bo[1] = bo[0];
+        pitch[1] = pitch[0];
+        offset[1] = offset[0] + pitch[0] * height;
+    }
+
+    modifier = hnd_to_modifier (hnd);
+    if (modifier != DRM_FORMAT_MOD_INVALID
+        && (dev->fb_modifiers || !is_implicit_layout (modifier))) {
+        uint64_t modifiers[4] = { 0 };
+
+        if (!dev->fb_modifiers) {
+            ALOGE ("driver can't create framebuffers with modifiers");
+            unref_gem (dev, bo[0]);
+            return -EINVAL;
+        }
+
+        modifiers[0] = modifier;
+        if (bo[1])
+            modifiers[1] = modifier;
+
+        ret =
+            drmModeAddFB2WithModifiers (dev->fd, width, height,
+            fmt->fourcc, bo, pitch, offset, modifiers, &kfb->fb_id,
+            DRM_MODE_FB_MODIFIERS);
+    } else {
+        ret =
+            drmModeAddFB2 (dev->fd, width, height, fmt->fourcc, bo, pitch,
+            offset, &kfb->fb_id, 0);
+    }
+    if (ret) {
+        ALOGE ("cannot create framebuffer (%d): %s\n", errno, strerror (errno));
+        unref_gem (dev, bo[0]);
+        return ret;
+    }
+
+    kfb->fourcc = fmt->fourcc;
+    kfb->width = width;
+    kfb->height = height;
+    kfb->modifier = modifier;
+    kfb->offset = offset[0];
+    kfb->handle = bo[0];
+    dev->num_fbs++;
+    dev->fbs_created++;
+    return 0;
+}
+
+/*
+ * Framebuffer cache
+ *
+ * A buffer queue cycles through a few buffers, so their framebuffers are
+ * kept instead of importing each buffer again every frame. They are looked
+ * up by the inode of the dma-buf, which can't be reused while the GEM
+ * handle holds it, and the offset of the buffer in it. A framebuffer is
+ * removed once every frame using it was replaced on screen, as reported by
+ * the shown_seq of the displays, and the device went FB_CACHE_FRAMES frames
+ * without it.
+ */
+static void
+remove_fb (kms_device_t * dev, kms_fb_t * kfb)
+{
+    if (kfb->fb_id)
+        drmModeRmFB (dev->fd, kfb->fb_id);
+    unref_gem (dev, kfb->handle);
+    memset (kfb, 0, sizeof (*kfb));
+    dev->num_fbs--;
+    dev->fbs_removed++;
+}
+
+static bool
+fb_released (hwc_context_t * ctx, kms_fb_t * kfb)
+{
+    for (int disp = 0; disp < HWC_NUM_PHYSICAL_DISPLAY_TYPES; disp++) {
+        unsigned shown = HWC_LOAD (&ctx->displays[disp].shown_seq);
+
+        if (kfb->last_seq[disp] && (int) (shown - kfb->last_seq[disp]) <= 0)
+            return false;
+    }
+    return true;
+}
+
+static void
+expire_fbs (hwc_context_t * ctx, kms_device_t * dev)
+{
+    for (unsigned int i = 0; i < MAX_CACHED_FBS; i++) {
+        kms_fb_t *kfb = &dev->fbs[i];
+
+        if (kfb->ino && dev->frames - kfb->last_frame > FB_CACHE_FRAMES
+            && fb_released (ctx, kfb))
+            remove_fb (dev, kfb);
+    }
+}
+
+/* free slot, or the least recently used framebuffer off screen */
+static kms_fb_t *
+alloc_fb (hwc_context_t * ctx, kms_device_t * dev)
+{
+    kms_fb_t *lru = NULL;
+
+    for (unsigned int i = 0; i < MAX_CACHED_FBS; i++) {
+        kms_fb_t *kfb = &dev->fbs[i];
+
+        if (!kfb->ino)
+            return kfb;
+        if (fb_released (ctx, kfb)
+            && (!lru || (int) (kfb->last_frame - lru->last_frame) < 0))
+            lru = kfb;
+    }
+
+    if (lru)
+        remove_fb (dev, lru);
+    return lru;
+}
+
+static void
+destroy_fbs (kms_device_t * dev)
+{
+    for (unsigned int i = 0; i < MAX_CACHED_FBS; i++)
+        if (dev->fbs[i].ino)
+            remove_fb (dev, &dev->fbs[i]);
+}
+
+static int
+get_buffer_fb (hwc_context_t * ctx, int disp, private_handle_t const *hnd,
+    uint32_t * fb)
+{
+    kms_display_t *kdisp = &ctx->displays[disp];
+    kms_device_t *dev = kdisp->dev;
+    struct stat st;
+    kms_fb_t *kfb;
+    int ret;
+
+    if (!hnd_to_format (hnd))
+        return -EINVAL;
+
+    if (hnd->share_fd < 0 || fstat (hnd->share_fd, &st)) {
+        ALOGE ("buffer %p has no dma-buf fd, flags 0x%x", hnd, hnd->flags);
+        return -EINVAL;
+    }
+
+    kfb = find_fb (dev, hnd, st.st_ino);
+    if (!kfb) {
+        kfb = alloc_fb (ctx, dev);
+        if (!kfb) {
+            ALOGE ("No framebuffer left on %s", dev->path);
+            return -ENOSPC;
+        }
+
+        ret = import_buffer (dev, hnd, kfb);
+        if (ret)
+            return ret;
+        kfb->ino = st.st_ino;
+    }
+
+    /* the frame being built gets the next sequence number */
+    kfb->last_frame = dev->frames;
+    kfb->last_seq[disp] = kdisp->frame_seq + 1;
+    *fb = kfb->fb_id;
+    return 0;
+}
+
+/*
+ * prepare: a layer only gets a plane once its framebuffer exists, a buffer
+ * the kernel rejects (not a dma-buf, unsupported pitch or size, ...) stays
+ * with GPU composition. The last rejected buffer isn't tried again.
+ */
+static bool
+can_import_buffer (hwc_context_t * ctx, int disp, private_handle_t const *hnd)
+{
+    kms_device_t *dev = ctx->displays[disp].dev;
+    struct stat st;
+    uint32_t fb;
+
+    if (!hnd || !hnd_to_format (hnd))
+        return false;
+
+    if (hnd->share_fd < 0 || fstat (hnd->share_fd, &st))
+        return false;
+
+    if (!is_implicit_layout (hnd_to_modifier (hnd)) && !dev->fb_modifiers)
+        return false;
+
+    if (st.st_ino == dev->rejected_ino)
+        return false;
+
+    if (get_buffer_fb (ctx, disp, hnd, &fb)) {
+        dev->rejected_ino = st.st_ino;
+        return false;
+    }
+
+    return true;
+}
+
+static int
+count_fds (void)
+{
+    DIR *dir = opendir ("/proc/self/fd");
+    struct dirent *entry;
+    int count = 0;
+
+    if (!dir)
+        return -1;
+
+    while ((entry = readdir (dir)))
+        if (entry->d_name[0] != '.')
+            count++;
+
+    closedir (dir);
+    return count - 1;           /* the directory itself */
+}
+
+/*
+ * Cross check the framebuffer and GEM handle accounting, and report the fds
+ * of the process each time their count reaches a new high, which is how a
+ * leak shows over a long uptime.
+ */
+static void
+check_resources (hwc_context_t * ctx)
+{
+    int fds = count_fds ();
+
+    for (unsigned int i = 0; i < ctx->num_devices; i++) {
+        kms_device_t *dev = &ctx->devices[i];
+        unsigned int fbs = 0, gems = 0, refs = 0;
+
+        if (dev->fd < 0)
+            continue;
+
+        for (unsigned int j = 0; j < MAX_CACHED_FBS; j++) {
+            if (dev->fbs[j].ino) {
+                fbs++;
+                if (!find_gem (dev, dev->fbs[j].handle))
+                    ALOGE ("%s: fb %u without GEM handle %u", dev->path,
+                        dev->fbs[j].fb_id, dev->fbs[j].handle);
+            }
+            if (dev->gems[j].refs) {
+                gems++;
+                refs += dev->gems[j].refs;
+            }
+        }
+
+        if (fbs != dev->num_fbs || refs != fbs || gems != dev->num_gems
+            || dev->fbs_created - dev->fbs_removed != fbs
+            || dev->gems_opened - dev->gems_closed != gems)
+            ALOGE ("%s: %u fbs, %u GEM handles with %u refs, %u fbs and %u "
+                "handles accounted", dev->path, fbs, gems, refs,
+                dev->num_fbs, dev->num_gems);
+    }
+
+    if (fds > ctx->fds_high) {
+        if (ctx->fds_high)
+            ALOGI ("Open fds up to %d", fds);
+        ctx->fds_high = fds;
+    }
+}
+
+static unsigned int
+plane_index (kms_device_t * dev, uint32_t plane_id)
+{
+    for (unsigned int i = 0; i < dev->num_planes; i++)
+        if (dev->planes[i].plane_id == plane_id)
+            return i;
+    return MAX_PLANES;
+}
+
+/*
+ * Static layers cache
+ *
+ * Layers which keep the same buffer and geometry for ctx->static_frames
+ * frames are considered static. A run of adjacent static layers is marked as
+ * overlay so SurfaceFlinger stops compositing it: the HWC blends the group
+ * once into a buffer of its own, scanned out from a single plane, and only
+ * redraws it when one of its members changes. The cache is opt-in through
+ * ro.hwc.static.frames and only takes the layers no plane was left for.
+ *
+ * hwc_set() picks a buffer no frame still uses, copies what the blend needs
+ * along with a dup of each buffer file, and queues it to the cache thread.
+ * That thread runs at normal priority, waits for the acquire fences of the
+ * group, blends it, then advances the cache timeline. The cache layer of the
+ * frame carries a fence on that timeline, so the event thread doesn't latch
+ * the frame before its buffer is drawn.
+ */
+static void
+layer_signature (hwc_layer_1_t * layer, kms_layer_sig_t * sig)
+{
+    sig->handle = layer->handle;
+    sig->displayFrame = layer->displayFrame;
+    sig->sourceCrop = layer_source_crop (layer);
+    sig->transform = layer->transform;
+    sig->blending = layer->blending;
+    sig->planeAlpha = layer->planeAlpha;
+}
+
+static bool
+same_signature (const kms_layer_sig_t * a, const kms_layer_sig_t * b)
+{
+    return a->handle == b->handle
+        && !memcmp (&a->displayFrame, &b->displayFrame, sizeof (hwc_rect_t))
+        && !memcmp (&a->sourceCrop, &b->sourceCrop, sizeof (hwc_rect_t))
+        && a->transform == b->transform
+        && a->blending == b->blending && a->planeAlpha == b->planeAlpha;
+}
+
+static void
+track_static_layers (hwc_context_t * ctx, int disp,
+    hwc_display_contents_1_t * content)
+{
+    kms_display_t *d = &ctx->displays[disp];
+    size_t count = content->numHwLayers;
+
+    if (count > MAX_TRACKED_LAYERS)
+        count = MAX_TRACKED_LAYERS;
+
+    for (size_t i = 0; i < count; i++) {
+        kms_layer_sig_t sig;
+
+        layer_signature (&content->hwLayers[i], &sig);
+        if (i < d->num_sigs && same_signature (&sig, &d->sigs[i])) {
+            if (d->static_frames[i] < UINT_MAX)
+                d->static_frames[i]++;
+        } else {
+            d->sigs[i] = sig;
+            d->static_frames[i] = 0;
+        }
+    }
+    d->num_sigs = count;
+}
+
+static bool
+is_cacheable_layer (hwc_context_t * ctx, int disp,
+    hwc_display_contents_1_t * content, size_t i)
+{
+    kms_display_t *d = &ctx->displays[disp];
+    hwc_layer_1_t *layer = &content->hwLayers[i];
+    private_handle_t const *hnd =
+        reinterpret_cast < private_handle_t const *>(layer->handle);
+
+    if (!ctx->static_frames || i >= d->num_sigs)
+        return false;
+
+    if (d->static_frames[i] < ctx->static_frames)
+        return false;
+
+    if (layer->compositionType == HWC_FRAMEBUFFER_TARGET
+        || (layer->flags & HWC_SKIP_LAYER))
+        return false;
+
+    if (!hnd || hnd->share_fd < 0 || layer->transform)
+        return false;
+
+    if (!is_implicit_layout (hnd_to_modifier (hnd)))
+        return false;
+
+    switch (hnd->format) {
+        case HAL_PIXEL_FORMAT_RGBA_8888:
+        case HAL_PIXEL_FORMAT_RGBX_8888:
+        case HAL_PIXEL_FORMAT_BGRA_8888:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool
+is_cached_layer (kms_display_t * d, size_t i)
+{
+    return d->cache.count && i >= d->cache.first
+        && i < d->cache.first + d->cache.count;
+}
+
+static void
+destroy_dumb (int drm_fd, kms_dumb_t * dumb)
+{
+    struct drm_mode_destroy_dumb destroy;
+
+    if (dumb->map)
+        munmap (dumb->map, dumb->size);
+    if (dumb->fb_id)
+        drmModeRmFB (drm_fd, dumb->fb_id);
+    if (dumb->handle) {
+        memset (&destroy, 0, sizeof (destroy));
+        destroy.handle = dumb->handle;
+        drmIoctl (drm_fd, DRM_IOCTL_MODE_DESTROY_DUMB, &destroy);
+    }
+    memset (dumb, 0, sizeof (*dumb));
+}
+
+static int
+create_dumb (int drm_fd, kms_dumb_t * dumb, uint32_t width, uint32_t height)
+{
+    struct drm_mode_create_dumb create;
+    struct drm_mode_map_dumb map;
+    uint32_t bo[4] = { 0 };
+    uint32_t pitch[4] = { 0 };
+    uint32_t offset[4] = { 0 };
+    void *ptr;
+
+    memset (&create, 0, sizeof (create));
+    create.width = width;
+    create.height = height;
+    create.bpp = 32;
+    if (drmIoctl (drm_fd, DRM_IOCTL_MODE_CREATE_DUMB, &create)) {
+        ALOGE ("cannot create dumb buffer %dx%d: %s", width, height,
+            strerror (errno));
+        return -errno;
+    }
+
+    dumb->handle = create.handle;
+    dumb->width = width;
+    dumb->height = height;
+    dumb->pitch = create.pitch;
+    dumb->size = create.size;
+
+    bo[0] = dumb->handle;
+    pitch[0] = dumb->pitch;
+    if (drmModeAddFB2 (drm_fd, width, height, DRM_FORMAT_ARGB8888, bo, pitch,
+            offset, &dumb->fb_id, 0)) {
+        ALOGE ("cannot create cache framebuffer: %s", strerror (errno));
+        goto err;
+    }
+
+    memset (&map, 0, sizeof (map));
+    map.handle = dumb->handle;
+    if (drmIoctl (drm_fd, DRM_IOCTL_MODE_MAP_DUMB, &map))
+        goto err;
+
+    ptr = mmap (NULL, dumb->size, PROT_READ | PROT_WRITE, MAP_SHARED, drm_fd,
+        map.offset);
+    if (ptr == MAP_FAILED)
+        goto err;
+    dumb->map = ptr;
+
+    return 0;
+
+err:
+    destroy_dumb (drm_fd, dumb);
+    return -EINVAL;
+}
+
+static void
+destroy_static_cache (int drm_fd, kms_static_cache_t * cache)
+{
+    for (int i = 0; i < STATIC_CACHE_BUFS; i++)
+        destroy_dumb (drm_fd, &cache->bufs[i].dumb);
+    free (cache->scratch);
+    memset (cache, 0, sizeof (*cache));
+}
+
+static inline uint32_t
+mul_alpha (uint32_t c, uint32_t a)
+{
+    return (c * a + 127) / 255;
+}
+
+/* blend one layer over the premultiplied ARGB8888 scratch buffer */
+static int
+composite_layer (kms_static_cache_t * cache, const hwc_rect_t & bbox,
+    const kms_static_src_t * layer)
+{
+    const hwc_rect_t & frame = layer->displayFrame;
+    const hwc_rect_t & crop = layer->sourceCrop;
+    uint32_t bw = bbox.right - bbox.left;
+    uint32_t src_pitch = layer->pitch;
+    uint32_t src_offset = layer->offset;
+    size_t src_size = src_offset + (size_t) src_pitch * layer->height;
+    const uint8_t *map;
+    int frame_w = frame.right - frame.left;
+    int frame_h = frame.bottom - frame.top;
+    int crop_w = crop.right - crop.left;
+    int crop_h = crop.bottom - crop.top;
+    bool swap_rb = layer->format != HAL_PIXEL_FORMAT_BGRA_8888;
+    bool opaque = layer->format == HAL_PIXEL_FORMAT_RGBX_8888
+        || layer->blending == HWC_BLENDING_NONE;
+    uint32_t plane_alpha = layer->planeAlpha;
+    const uint8_t *src;
+
+    if (frame_w <= 0 || frame_h <= 0 || crop_w <= 0 || crop_h <= 0)
+        return 0;
+
+    map = (const uint8_t *) mmap (NULL, src_size, PROT_READ, MAP_SHARED,
+        layer->fd, 0);
+    if (map == MAP_FAILED) {
+        ALOGE ("cannot map layer buffer: %s", strerror (errno));
+        return -errno;
+    }
+    src = map + src_offset;
+
+    for (int y = frame.top; y < frame.bottom; y++) {
+        int sy = crop.top + (y - frame.top) * crop_h / frame_h;
+        const uint32_t *src_row =
+            (const uint32_t *) (src + (size_t) sy * src_pitch);
+        uint32_t *dst_row = cache->scratch + (size_t) (y - bbox.top) * bw;
+
+        if (y < bbox.top || y >= bbox.bottom || sy < 0 || sy >= layer->height)
+            continue;
+
+        for (int x = frame.left; x < frame.right; x++) {
+            int sx = crop.left + (x - frame.left) * crop_w / frame_w;
+            uint32_t p, a, r, g, b, inv, d;
+
+            if (x < bbox.left || x >= bbox.right || sx < 0
+                || sx >= layer->width)
+                continue;
+
+            p = src_row[sx];
+            if (swap_rb)
+                p = (p & 0xff00ff00) | ((p >> 16) & 0xff) | ((p & 0xff) << 16);
+
+            a = opaque ? 0xff : p >> 24;
+            r = (p >> 16) & 0xff;
+            g = (p >> 8) & 0xff;
+            b = p & 0xff;
+
+            if (layer->blending == HWC_BLENDING_COVERAGE && !opaque) {
+                r = mul_alpha (r, a);
+                g = mul_alpha (g, a);
+                b = mul_alpha (b, a);
+            }
+            if (plane_alpha != 0xff) {
+                a = mul_alpha (a, plane_alpha);
+                r = mul_alpha (r, plane_alpha);
+                g = mul_alpha (g, plane_alpha);
+                b = mul_alpha (b, plane_alpha);
+            }
+
+            d = dst_row[x - bbox.left];
+            inv = 0xff - a;
+            a += mul_alpha (d >> 24, inv);
+            r += mul_alpha ((d >> 16) & 0xff, inv);
+            g += mul_alpha ((d >> 8) & 0xff, inv);
+            b += mul_alpha (d & 0xff, inv);
+            dst_row[x - bbox.left] = (a << 24) | (r << 16) | (g << 8) | b;
+        }
+    }
+
+    munmap ((void *) map, src_size);
+    return 0;
+}
+
+/* cache thread: draw a buffer of the cache before its frame is latched */
+static int
+draw_static_buf (kms_static_cache_t * cache, kms_static_buf_t * buf)
+{
+    uint32_t width = buf->bbox.right - buf->bbox.left;
+    uint32_t height = buf->bbox.bottom - buf->bbox.top;
+    TRACE_SCOPE (TRACE_FRAME, "draw_static_buf", buf->job_seq);
+
+    if (cache->scratch_size < (size_t) width * height) {
+        free (cache->scratch);
+        cache->scratch_size = (size_t) width * height;
+        cache->scratch =
+            (uint32_t *) malloc (cache->scratch_size * sizeof (uint32_t));
+        if (!cache->scratch) {
+            cache->scratch_size = 0;
+            return -ENOMEM;
+        }
+    }
+    memset (cache->scratch, 0, (size_t) width * height * sizeof (uint32_t));
+
+    for (size_t i = 0; i < buf->count; i++)
+        if (composite_layer (cache, buf->bbox, &buf->srcs[i]))
+            return -EINVAL;
+
+    for (uint32_t y = 0; y < height; y++)
+        memcpy ((uint8_t *) buf->dumb.map + (size_t) y * buf->dumb.pitch,
+            cache->scratch + (size_t) y * width, width * sizeof (uint32_t));
+
+    return 0;
+}
+
+static void
+wake_cache_thread (hwc_context_t * ctx)
+{
+    char c = 0;
+
+    write (ctx->cache_wake_fds[1], &c, 1);
+}
+
+/* draw the buffers queued by hwc_set(), in order, then signal them */
+static void
+drain_static_cache (kms_display_t * kdisp)
+{
+    kms_static_cache_t *cache = &kdisp->cache;
+    unsigned tail = HWC_LOAD (&cache->job_tail);
+
+    for (unsigned head = cache->job_head; head != tail; head++) {
+        kms_static_buf_t *buf = &cache->bufs[cache->jobs[head %
+                STATIC_CACHE_BUFS]];
+
+        if (buf->fence >= 0) {
+            if (sync_wait (buf->fence, 1000) < 0)
+                ALOGE ("%s: sync_wait error: %s", __FUNCTION__,
+                    strerror (errno));
+            close (buf->fence);
+            buf->fence = -1;
+        }
+
+        if (draw_static_buf (cache, buf))
+            ALOGE ("static layers cache draw failed");
+
+        for (size_t i = 0; i < buf->count; i++) {
+            close (buf->srcs[i].fd);
+            buf->srcs[i].fd = -1;
+        }
+
+        sw_sync_timeline_inc (kdisp->cache_timeline, 1);
+        HWC_STORE (&buf->busy, false);
+        HWC_STORE (&cache->job_head, head + 1);
+    }
+}
+
+static void *
+cache_handler (void *arg)
+{
+    hwc_context_t *ctx = (hwc_context_t *) arg;
+    struct pollfd pfd = { ctx->cache_wake_fds[0], POLLIN, 0 };
+    char buf[32];
+
+    /* blending is never worth delaying a commit or a vsync */
+    setpriority (PRIO_PROCESS, 0, 0);
+
+    while (1) {
+        if (poll (&pfd, 1, -1) < 0 && errno != EINTR) {
+            ALOGE ("Static cache thread error %d", errno);
+            break;
+        }
+        while (read (ctx->cache_wake_fds[0], buf, sizeof (buf)) > 0);
+
+        for (int disp = 0; disp < HWC_NUM_PHYSICAL_DISPLAY_TYPES; disp++)
+            drain_static_cache (&ctx->displays[disp]);
+    }
+    return NULL;
+}
+
+/* copy a cached layer for the cache thread, which outlives its handle */
+static int
+copy_static_src (hwc_layer_1_t * layer, kms_static_src_t * src)
+{
+    private_handle_t const *hnd =
+        reinterpret_cast < private_handle_t const *>(layer->handle);
+
+    src->fd = fcntl (hnd->share_fd, F_DUPFD_CLOEXEC, 0);
+    if (src->fd < 0)
+        return -errno;
+
+    src->format = hnd->format;
+    src->width = hnd->width;
+    src->height = hnd->height;
+    src->pitch = hnd_to_pitch (hnd, 4);
+    src->offset = hnd_to_offset (hnd);
+    src->displayFrame = layer->displayFrame;
+    src->sourceCrop = layer_source_crop (layer);
+    src->blending = layer->blending;
+    src->planeAlpha = layer->planeAlpha;
+    return 0;
+}
+
+/* the group is drawn once all its members are ready */
+static void
+take_static_fences (hwc_layer_1_t * layer, kms_static_buf_t * buf)
+{
+    int merged;
+
+    if (layer->acquireFenceFd < 0)
+        return;
+
+    if (buf->fence < 0) {
+        buf->fence = layer->acquireFenceFd;
+        layer->acquireFenceFd = -1;
+        return;
+    }
+
+    merged = sync_merge ("hwc_cache", buf->fence, layer->acquireFenceFd);
+    if (merged >= 0) {
+        close (buf->fence);
+        buf->fence = merged;
+    } else if (sync_wait (layer->acquireFenceFd, 1000) < 0) {
+        ALOGE ("%s: sync_wait error: %s", __FUNCTION__, strerror (errno));
+    }
+    close (layer->acquireFenceFd);
+    layer->acquireFenceFd = -1;
+}
+
+/*
+ * Return the buffer holding the cached group of this frame. When one of the
+ * members changed, a buffer which is no longer queued, drawn nor on screen
+ * gets the new group, handed over to the cache thread.
+ */
+static int
+update_static_cache (hwc_context_t * ctx, int disp,
+    hwc_display_contents_1_t * display)
+{
+    kms_display_t *kdisp = &ctx->displays[disp];
+    kms_static_cache_t *cache = &kdisp->cache;
+    int drm_fd = kdisp->dev->fd;
+    uint32_t width = cache->bbox.right - cache->bbox.left;
+    uint32_t height = cache->bbox.bottom - cache->bbox.top;
+    bool dirty = cache->num_built != cache->count;
+    unsigned shown = HWC_LOAD (&kdisp->shown_seq);
+    kms_static_buf_t *back = NULL;
+    int idx = -1;
+
+    for (size_t i = 0; i < cache->count && !dirty; i++) {
+        kms_layer_sig_t sig;
+
+        layer_signature (&display->hwLayers[cache->first + i], &sig);
+        dirty = !same_signature (&sig, &cache->built[i]);
+    }
+
+    if (!dirty) {
+        idx = cache->front;
+        cache->bufs[idx].last_seq = kdisp->frame_seq + 1;
+        return idx;
+    }
+
+    for (int i = 0; i < STATIC_CACHE_BUFS && idx < 0; i++) {
+        kms_static_buf_t *buf = &cache->bufs[i];
+
+        if (i != cache->front && !HWC_LOAD (&buf->busy) && (!buf->last_seq
+                || (int) (shown - buf->last_seq) > 0))
+            idx = i;
+    }
+    if (idx < 0)
+        return -EBUSY;
+
+    back = &cache->bufs[idx];
+    if (back->dumb.width != width || back->dumb.height != height) {
+        destroy_dumb (drm_fd, &back->dumb);
+        if (create_dumb (drm_fd, &back->dumb, width, height))
+            return -ENOMEM;
+    }
+
+    for (size_t i = 0; i < cache->count; i++) {
+        if (copy_static_src (&display->hwLayers[cache->first + i],
+                &back->srcs[i])) {
+            ALOGE ("cannot dup layer buffer: %s", strerror (errno));
+            while (i--)
+                close (back->srcs[i].fd);
+            return -EMFILE;
+        }
+    }
+
+    back->bbox = cache->bbox;
+    back->count = cache->count;
+    back->fence = -1;
+    for (size_t i = 0; i < cache->count; i++) {
+        hwc_layer_1_t *layer = &display->hwLayers[cache->first + i];
+
+        take_static_fences (layer, back);
+        layer_signature (layer, &cache->built[i]);
+    }
+    back->job_seq = ++cache->job_seq;
+    back->last_seq = kdisp->frame_seq + 1;
+
+    HWC_STORE (&back->busy, true);
+    cache->jobs[cache->job_tail % STATIC_CACHE_BUFS] = idx;
+    HWC_STORE (&cache->job_tail, cache->job_tail + 1);
+    wake_cache_thread (ctx);
+
+    cache->num_built = cache->count;
+    cache->front = idx;
+
+    return idx;
+}
+
+/*
+ * Render scaling
+ *
+ * With persist.hwc.render_scale below 100, the primary display reports that
+ * share of its resolution to SurfaceFlinger. The crtc scans out a black
+ * buffer of the mode size, the client target is upscaled on the primary
+ * plane and the overlays are stretched to match.
+ *
+ * HWC1 can't change the display size while SurfaceFlinger runs, so with
+ * ro.hwc.render_scale.auto the scale measured from client composition time
+ * is stored for the next start.
+ */
+static const int render_scale_steps[] = { 100, 75, 50 };
+
+/*
+ * Nothing tells whether the primary plane scales but trying it: a black
+ * buffer of the render size is shown upscaled before that size is reported.
+ */
+static int
+test_upscale (hwc_context_t * ctx, int disp, int width, int height)
+{
+    kms_display_t *d = &ctx->displays[disp];
+    int drm_fd = d->dev->fd;
+    kms_dumb_t test;
+    int ret;
+
+    memset (&test, 0, sizeof (test));
+    if (create_dumb (drm_fd, &d->modeset_fb, d->mode->hdisplay,
+            d->mode->vdisplay))
+        return -ENOMEM;
+    if (create_dumb (drm_fd, &test, width, height)) {
+        destroy_dumb (drm_fd, &d->modeset_fb);
+        return -ENOMEM;
+    }
+
+    ret = drmModeSetCrtc (drm_fd, d->crtc_id, d->modeset_fb.fb_id, 0, 0,
+        &d->con->connector_id, 1, d->mode);
+    if (!ret)
+        ret = drmModeSetPlane (drm_fd, d->primary_plane_id, d->crtc_id,
+            test.fb_id, 0, 0, 0, d->mode->hdisplay, d->mode->vdisplay,
+            0, 0, width << 16, height << 16);
+
+    destroy_dumb (drm_fd, &test);
+    if (ret)
+        destroy_dumb (drm_fd, &d->modeset_fb);
+    else {
+        d->crtc_fb = d->modeset_fb.fb_id;
+        d->crtc_set_mode = d->mode;
+    }
+
+    return ret;
+}
+
+static void
+init_render_scale (hwc_context_t * ctx, int disp)
+{
+    kms_display_t *d = &ctx->displays[disp];
+    char prop_val[PROPERTY_VALUE_MAX];
+    int scale, width, height;
+
+    d->primary_plane_id = d->dev->primary_planes[d->pipe];
+
+    property_get ("persist.hwc.render_scale", prop_val, "100");
+    scale = atoi (prop_val);
+    if (scale <= 0 || scale >= 100)
+        return;
+
+    if (!d->primary_plane_id) {
+        ALOGE ("Display %d: no primary plane to upscale from\n", disp);
+        return;
+    }
+
+    scale = MAX (scale, render_scale_steps[ARRAY_SIZE (render_scale_steps) - 1]);
+    width = (d->mode->hdisplay * scale / 100) & ~1;
+    height = (d->mode->vdisplay * scale / 100) & ~1;
+
+    if (test_upscale (ctx, disp, width, height)) {
+        ALOGE ("Display %d can't upscale from %dx%d: %s\n", disp, width,
+            height, strerror (errno));
+        property_set ("persist.hwc.render_scale", "100");
+        return;
+    }
+
+    d->render_scale = d->render_scale_next = d->render_scale_saved = scale;
+    d->width = width;
+    d->height = height;
+
+    ALOGI ("Display %d: rendering at %dx%d (%d%%)\n", disp, d->width,
+        d->height, scale);
+}
+
+/* from render resolution to mode resolution */
+static hwc_rect_t
+scale_rect (kms_display_t * kdisp, const hwc_rect_t & r)
+{
+    hwc_rect_t out = r;
+
+    if (kdisp->render_scale == 100)
+        return out;
+
+    out.left = r.left * kdisp->mode->hdisplay / kdisp->width;
+    out.top = r.top * kdisp->mode->vdisplay / kdisp->height;
+    out.right = r.right * kdisp->mode->hdisplay / kdisp->width;
+    out.bottom = r.bottom * kdisp->mode->vdisplay / kdisp->height;
+    return out;
+}
+
+static int64_t
+fence_signal_time (int fence)
+{
+    struct sync_fence_info_data *info = sync_fence_info (fence);
+    struct sync_pt_info *pt = NULL;
+    int64_t ts = 0;
+
+    if (!info)
+        return 0;
+
+    while ((pt = sync_pt_info (info, pt)))
+        if (pt->status == 1)
+            ts = MAX (ts, (int64_t) pt->timestamp_ns);
+
+    sync_fence_info_free (info);
+    return ts;
+}
+
+/* event thread, the scale is stored by hwc_set() */
+static void
+set_render_scale_next (kms_display_t * kdisp, int scale)
+{
+    HWC_STORE (&kdisp->render_scale_next, scale);
+    kdisp->scale_over = kdisp->scale_under = 0;
+}
+
+/* hwc_set(): property_set() waits on init, which the event thread can't */
+static void
+save_render_scale (kms_display_t * kdisp)
+{
+    int scale = HWC_LOAD (&kdisp->render_scale_next);
+    char prop_val[PROPERTY_VALUE_MAX];
+
+    if (scale == kdisp->render_scale_saved)
+        return;
+    kdisp->render_scale_saved = scale;
+
+    snprintf (prop_val, sizeof (prop_val), "%d", scale);
+    if (property_set ("persist.hwc.render_scale", prop_val))
+        ALOGE ("Failed to store render scale %d%%\n", scale);
+    else
+        ALOGI ("Render scale %d%% from next start\n", scale);
+}
+
+/* event thread, once the fences of a frame are signaled */
+static void
+update_render_scale (hwc_context_t * ctx, int disp, kms_frame_t * frame)
+{
+    kms_display_t *kdisp = &ctx->displays[disp];
+    int64_t period = mode_vsync_period (kdisp->mode);
+    int scale = kdisp->render_scale;
+    int lower = 0, higher = 0;
+    int64_t done = 0, estimate;
+
+    if (!ctx->render_scale_auto || disp != HWC_DISPLAY_PRIMARY
+        || !kdisp->primary_plane_id || !frame->prepare_ns)
+        return;
+
+    for (unsigned int i = 0; i < frame->num_layers; i++)
+        if (frame->layers[i].type == HWC_FRAMEBUFFER_TARGET
+            && frame->layers[i].acquire_fence >= 0)
+            done = fence_signal_time (frame->layers[i].acquire_fence);
+    if (done <= frame->prepare_ns)
+        return;
+
+    kdisp->client_ewma_ns += (done - frame->prepare_ns -
+        kdisp->client_ewma_ns) / 16;
+
+    /* a step is only measured once the next start runs at it */
+    if (kdisp->render_scale_next != kdisp->render_scale)
+        return;
+
+    for (unsigned int i = 0; i < ARRAY_SIZE (render_scale_steps); i++) {
+        if (render_scale_steps[i] < scale && !lower)
+            lower = render_scale_steps[i];
+        if (render_scale_steps[i] > scale)
+            higher = render_scale_steps[i];
+    }
+
+    /* composition time follows the pixel count */
+    estimate = higher ? kdisp->client_ewma_ns * higher * higher /
+        (kdisp->render_scale * kdisp->render_scale) : 0;
+
+    if (kdisp->client_ewma_ns * 100 > period * RENDER_SCALE_DOWN_PERCENT) {
+        kdisp->scale_under = 0;
+        if (lower && ++kdisp->scale_over >= RENDER_SCALE_FRAMES)
+            set_render_scale_next (kdisp, lower);
+    } else if (higher && estimate * 100 < period * RENDER_SCALE_UP_PERCENT) {
+        kdisp->scale_over = 0;
+        if (++kdisp->scale_under >= 4 * RENDER_SCALE_FRAMES)
+            set_render_scale_next (kdisp, higher);
+    } else {
+        kdisp->scale_over = kdisp->scale_under = 0;
+    }
+}
+
+static void
+close_frame_fences (kms_frame_t * frame)
+{
+    for (unsigned int i = 0; i < frame->num_layers; i++) {
+        if (frame->layers[i].acquire_fence >= 0) {
+            close (frame->layers[i].acquire_fence);
+            frame->layers[i].acquire_fence = -1;
+        }
+    }
+}
+
+static kms_frame_layer_t *
+add_frame_layer (kms_frame_t * frame, int type, uint32_t fb_id,
+    uint32_t plane_id, const hwc_rect_t & displayFrame,
+    const hwc_rect_t & sourceCrop)
+{
+    kms_frame_layer_t *l;
+
+    if (frame->num_layers == MAX_FRAME_LAYERS)
+        return NULL;
+
+    l = &frame->layers[frame->num_layers++];
+    l->type = type;
+    l->fb_id = fb_id;
+    l->plane_id = plane_id;
+    l->displayFrame = displayFrame;
+    l->sourceCrop = sourceCrop;
+    l->acquire_fence = -1;
+    return l;
+}
+
+/*
+ * Import the buffers of the display contents and take over their acquire
+ * fences. Nothing is waited for here, the frame is latched by the event
+ * thread once its fences are signaled.
+ */
+static int
+build_frame (hwc_context_t * ctx, int disp,
+    hwc_display_contents_1_t * display, kms_frame_t * frame)
+{
+    int ret = 0;
+    uint32_t fb = 0;
+
+    kms_display_t *kdisp = &ctx->displays[disp];
+    kms_frame_layer_t *cache_layer = NULL;
+
+    frame->num_layers = 0;
+
+    for (size_t i = 0; i < display->numHwLayers; i++) {
+        hwc_layer_1_t *target = &display->hwLayers[i];
+        kms_frame_layer_t *l = NULL;
+
+        if (!target)
+            continue;
+
+        if (is_cached_layer (kdisp, i)) {
+            kms_static_cache_t *cache = &kdisp->cache;
+
+            if (i == cache->first) {
+                hwc_rect_t crop = { 0, 0,
+                    cache->bbox.right - cache->bbox.left,
+                    cache->bbox.bottom - cache->bbox.top };
+                int idx = update_static_cache (ctx, disp, display);
+
+                if (idx >= 0)
+                    cache_layer = add_frame_layer (frame, HWC_OVERLAY,
+                        cache->bufs[idx].dumb.fb_id, cache->plane_id,
+                        cache->bbox, crop);
+                if (!cache_layer) {
+                    ALOGE ("static layers cache update failed");
+                    kdisp->cache.num_built = 0;
+                    kdisp->num_sigs = 0;
+                } else if (HWC_LOAD (&cache->bufs[idx].busy)) {
+                    /* latched once the cache thread drew the buffer */
+                    cache_layer->acquire_fence =
+                        sw_sync_fence_create (kdisp->cache_timeline,
+                        "hwc_cache", cache->bufs[idx].job_seq);
+                }
+            }
+
+            /* taken by the cache thread when the group was redrawn */
+            if (target->acquireFenceFd >= 0) {
+                close (target->acquireFenceFd);
+                target->acquireFenceFd = -1;
+            }
+            continue;
+        }
+
+        private_handle_t const *hnd =
+            reinterpret_cast < private_handle_t const *>(target->handle);
+
+        if (!hnd)
+            continue;
+
+        if ((display->hwLayers[i].compositionType != HWC_FRAMEBUFFER_TARGET)
+            && (display->hwLayers[i].compositionType != HWC_OVERLAY))
+            continue;
+
+        ret = get_buffer_fb (ctx, disp, hnd, &fb);
+        if (!ret)
+            l = add_frame_layer (frame, target->compositionType, fb,
+                i < kdisp->num_assigned ? kdisp->assigned[i].plane_id : 0,
+                target->displayFrame, layer_source_crop (target));
+
+        if (ret || !l) {
+            /* the client target is mandatory, a lost overlay is not */
+            if (display->hwLayers[i].compositionType == HWC_FRAMEBUFFER_TARGET) {
+                close_frame_fences (frame);
+                return ret ? ret : -ENOSPC;
+            }
+            continue;
+        }
+
+        l->acquire_fence = target->acquireFenceFd;
+        target->acquireFenceFd = -1;
+    }
+
+    return 0;
+}
+
+/* show the client target upscaled on the primary plane */
+static int
+show_scaled_target (hwc_context_t * ctx, int disp)
+{
+    kms_display_t *kdisp = &ctx->displays[disp];
+    int ret;
+    TRACE_SCOPE (TRACE_KMS, "drmModeSetPlane primary", -1);
+
+    ret = drmModeSetPlane (kdisp->dev->fd, kdisp->primary_plane_id,
+        kdisp->crtc_id, kdisp->target_fb, 0, 0, 0, kdisp->mode->hdisplay,
+        kdisp->mode->vdisplay, 0, 0, kdisp->width << 16,
+        kdisp->height << 16);
+    if (ret && kdisp->render_scale_next != 100) {
+        ALOGE ("Display %d can't upscale: %s\n", disp, strerror (errno));
+        set_render_scale_next (kdisp, 100);
+    }
+
+    return ret;
+}
+
+/* mode the crtc runs at, the slower one while idle without variable refresh */
+static drmModeModeInfoPtr
+crtc_mode (kms_display_t * kdisp)
+{
+    if (kdisp->idle && !kdisp->vrr_prop_id && kdisp->idle_mode)
+        return kdisp->idle_mode;
+    return kdisp->mode;
+}
+
+/*
+ * Program the crtc with the given mode and the last client target, or the
+ * black buffer of the mode size when the client target is upscaled.
+ */
+static int
+set_crtc (hwc_context_t * ctx, int disp, drmModeModeInfoPtr mode)
+{
+    kms_display_t *kdisp = &ctx->displays[disp];
+    int drm_fd = kdisp->dev->fd;
+    uint32_t fb = kdisp->target_fb;
+    int ret;
+
+    if (kdisp->render_scale != 100) {
+        if (!kdisp->modeset_fb.fb_id
+            && create_dumb (drm_fd, &kdisp->modeset_fb, kdisp->mode->hdisplay,
+                kdisp->mode->vdisplay))
+            return -ENOMEM;
+        fb = kdisp->modeset_fb.fb_id;
+    }
+
+    {
+        TRACE_SCOPE (TRACE_KMS, "drmModeSetCrtc", -1);
+        ret = drmModeSetCrtc (drm_fd, kdisp->crtc_id, fb, 0, 0,
+            &kdisp->con->connector_id, 1, mode);
+    }
+    if (ret)
+        return ret;
+    kdisp->crtc_fb = fb;
+    kdisp->crtc_set_mode = mode;
+
+    if (kdisp->render_scale != 100 && kdisp->target_fb)
+        ret = show_scaled_target (ctx, disp);
+
+    return ret;
+}
+
+/*
+ * Show the client target. Once the crtc runs the wanted mode at full render
+ * scale, a page flip swaps the buffer without blocking until the vblank: the
+ * frame reaches the screen with the flip event.
+ */
+static void
+commit_target (hwc_context_t * ctx, int disp, uint32_t fb)
+{
+    kms_display_t *kdisp = &ctx->displays[disp];
+
+    kdisp->target_fb = fb;
+
+    if (kdisp->render_scale == 100 && kdisp->crtc_fb
+        && kdisp->crtc_fb != kdisp->modeset_fb.fb_id
+        && kdisp->crtc_set_mode == crtc_mode (kdisp)) {
+        TRACE_SCOPE (TRACE_KMS, "drmModePageFlip", -1);
+
+        if (fb == kdisp->crtc_fb)
+            return;
+        if (!drmModePageFlip (kdisp->dev->fd, kdisp->crtc_id, fb,
+                DRM_MODE_PAGE_FLIP_EVENT, kdisp)) {
+            kdisp->crtc_fb = fb;
+            kdisp->flip_pending = true;
+            return;
+        }
+    }
+
+    /* an upscaled target only needs the modeset once per mode */
+    if (kdisp->render_scale == 100 || !kdisp->crtc_fb
+        || kdisp->crtc_fb != kdisp->modeset_fb.fb_id
+        || kdisp->crtc_set_mode != crtc_mode (kdisp))
+        set_crtc (ctx, disp, crtc_mode (kdisp));
+    else
+        show_scaled_target (ctx, disp);
+}
+
+/* the plane scans out the layer as of the last commit */
+static bool
+same_frame_layer (kms_display_t * kdisp, unsigned int i,
+    const kms_frame_layer_t * l)
+{
+    const kms_frame_layer_t *c = &kdisp->committed.layers[i];
+
+    return i < kdisp->committed.num_layers && c->plane_id == l->plane_id
+        && c->fb_id == l->fb_id
+        && !memcmp (&c->displayFrame, &l->displayFrame, sizeof (hwc_rect_t))
+        && !memcmp (&c->sourceCrop, &l->sourceCrop, sizeof (hwc_rect_t));
+}
+
+/*
+ * Legacy plane updates block until a vblank on atomic drivers, so only the
+ * planes which changed are touched, and the client target goes last where
+ * its page flip doesn't wait for them.
+ */
+static void
+commit_frame (hwc_context_t * ctx, int disp, kms_frame_t * frame)
+{
+    kms_display_t *kdisp = &ctx->displays[disp];
+    kms_device_t *dev = kdisp->dev;
+    kms_frame_layer_t *target = NULL;
+    uint64_t active_planes = 0;
+    int zorder = 1;
+    TRACE_SCOPE (TRACE_FRAME, "commit_frame", frame->seq);
+
+    for (unsigned int i = 0; i < frame->num_layers; i++) {
+        kms_frame_layer_t *l = &frame->layers[i];
+
+        if (l->type == HWC_FRAMEBUFFER_TARGET) {
+            target = l;
+            zorder++;
+            continue;
+        }
+
+        unsigned int index = plane_index (dev, l->plane_id);
+
+        /* left as is, its zorder follows the layer index */
+        if (index < MAX_PLANES && (kdisp->active_planes & (1ULL << index))
+            && same_frame_layer (kdisp, i, l)) {
+            active_planes |= 1ULL << index;
+            zorder++;
+            continue;
+        }
+
+        TRACE_SCOPE (TRACE_KMS, "drmModeSetPlane", frame->seq);
+        hwc_rect_t dst = scale_rect (kdisp, l->displayFrame);
+
+        set_zorder (dev, l->plane_id, zorder++);
+
+        /* the layer is lost for this frame, the GPU gets it from the next */
+        if (drmModeSetPlane (dev->fd, l->plane_id, kdisp->crtc_id, l->fb_id, 0,
+                dst.left, dst.top, dst.right - dst.left, dst.bottom - dst.top,
+                l->sourceCrop.left << 16,
+                l->sourceCrop.top << 16,
+                (l->sourceCrop.right - l->sourceCrop.left) << 16,
+                (l->sourceCrop.bottom - l->sourceCrop.top) << 16)) {
+            ALOGE ("Plane %u rejected fb %u: %s", l->plane_id, l->fb_id,
+                strerror (errno));
+            if (index < MAX_PLANES)
+                HWC_STORE (&dev->planes[index].rejected, true);
+            continue;
+        }
+        active_planes |= 1ULL << index;
+    }
+
+    /* turn off the planes left over from the previous frame */
+    for (unsigned int i = 0; i < dev->num_planes; i++) {
+        if ((kdisp->active_planes & ~active_planes) & (1ULL << i)) {
+            TRACE_SCOPE (TRACE_KMS, "drmModeSetPlane off", frame->seq);
+            drmModeSetPlane (dev->fd, dev->planes[i].plane_id,
+                kdisp->crtc_id, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+        }
+    }
+    kdisp->active_planes = active_planes;
+
+    if (target)
+        commit_target (ctx, disp, target->fb_id);
+
+    kdisp->committed = *frame;
+}
+
+/*
+ * Idle refresh rate
+ *
+ * Once no frame was committed for ctx->idle_timeout_ns and SurfaceFlinger
+ * doesn't listen to vsync, the crtc either switches to variable refresh rate
+ * or to a slower mode of the same resolution. The first frame or vsync
+ * request brings the full rate back, so SurfaceFlinger only ever sees vsync
+ * events at the period it was told about.
+ *
+ * Switching modes is a full modeset, which blanks the screen on some drivers
+ * and can't be tested first through the legacy API: it is only done with
+ * ro.hwc.idle.modeset set, otherwise displays without variable refresh stay
+ * at full rate. A frame ending the idle period sets the full rate mode along
+ * with its client target rather than through a modeset of its own.
+ */
+static void
+enter_idle (hwc_context_t * ctx, int disp)
+{
+    kms_display_t *kdisp = &ctx->displays[disp];
+
+    /* a failed attempt is retried once another timeout went by */
+    kdisp->idle_retry_ns = now_ns ();
+
+    if (kdisp->vrr_prop_id) {
+        if (drmModeObjectSetProperty (kdisp->dev->fd, kdisp->crtc_id,
+                DRM_MODE_OBJECT_CRTC, kdisp->vrr_prop_id, 1))
+            return;
+    } else if (kdisp->idle_mode && kdisp->target_fb) {
+        if (set_crtc (ctx, disp, kdisp->idle_mode))
+            return;
+        kdisp->vsync_period_ns = mode_vsync_period (kdisp->idle_mode);
+    } else {
+        return;
+    }
+
+    kdisp->idle = true;
+}
+
+/* without modeset, the next client target commit restores the mode */
+static void
+exit_idle (hwc_context_t * ctx, int disp, bool modeset)
+{
+    kms_display_t *kdisp = &ctx->displays[disp];
+
+    if (!kdisp->idle)
+        return;
+
+    if (kdisp->vrr_prop_id)
+        drmModeObjectSetProperty (kdisp->dev->fd, kdisp->crtc_id,
+            DRM_MODE_OBJECT_CRTC, kdisp->vrr_prop_id, 0);
+    else if (modeset)
+        set_crtc (ctx, disp, kdisp->mode);
+
+    kdisp->vsync_period_ns = mode_vsync_period (kdisp->mode);
+    kdisp->idle = false;
+}
+
+static bool
+idle_allowed (hwc_context_t * ctx, kms_display_t * kdisp)
+{
+    return ctx->idle_timeout_ns && (kdisp->vrr_prop_id || kdisp->idle_mode)
+        && kdisp->power_mode == HWC_POWER_MODE_NORMAL
+        && kdisp->last_commit_ns && !HWC_LOAD (&kdisp->vsync_on);
+}
+
+static int64_t
+idle_deadline (hwc_context_t * ctx, kms_display_t * kdisp)
+{
+    return MAX (kdisp->last_commit_ns, kdisp->idle_retry_ns) +
+        ctx->idle_timeout_ns;
+}
+
+static void
+idle_wait (hwc_context_t * ctx, int disp, int64_t * deadline)
+{
+    kms_display_t *kdisp = &ctx->displays[disp];
+    int64_t idle;
+
+    if (kdisp->idle || !idle_allowed (ctx, kdisp))
+        return;
+
+    idle = idle_deadline (ctx, kdisp);
+    if (*deadline < 0 || idle < *deadline)
+        *deadline = idle;
+}
+
+static void
+update_idle (hwc_context_t * ctx, int disp, int64_t now)
+{
+    kms_display_t *kdisp = &ctx->displays[disp];
+
+    if (kdisp->power_mode != HWC_POWER_MODE_NORMAL)
+        return;
+
+    if (kdisp->idle) {
+        if (HWC_LOAD (&kdisp->vsync_on))
+            exit_idle (ctx, disp, true);
+    } else if (idle_allowed (ctx, kdisp) && now >= idle_deadline (ctx, kdisp)) {
+        enter_idle (ctx, disp);
+    }
+}
+
+/*
+ * Late latching
+ *
+ * hwc_set() only queues frames. The event thread holds them until the
+ * latching margin before the next predicted vblank, then commits the newest
+ * queued frame whose acquire fences are all signaled; the older ones are
+ * dropped without ever reaching the screen. The margin follows the measured
+ * commit time and grows when a commit ends, or its page flip lands, after the
+ * vblank it targeted. No frame is latched while a page flip is in flight.
+ */
+static void
+wake_event_thread (hwc_context_t * ctx)
+{
+    char c = 0;
+
+    write (ctx->wake_fds[1], &c, 1);
+}
+
+static void
+signal_event_done (hwc_context_t * ctx)
+{
+    char c = 0;
+
+    write (ctx->done_fds[1], &c, 1);
+}
+
+/* block the SurfaceFlinger thread until the event thread made progress */
+static void
+wait_event_done (hwc_context_t * ctx, int timeout_ms)
+{
+    struct pollfd pfd = { ctx->done_fds[0], POLLIN, 0 };
+    char buf[32];
+
+    if (poll (&pfd, 1, timeout_ms) > 0)
+        while (read (ctx->done_fds[0], buf, sizeof (buf)) > 0);
+}
+
+/* wait for the event thread to carry out request seq */
+static int
+wait_request (hwc_context_t * ctx, unsigned *done_seq, unsigned seq)
+{
+    int64_t timeout = now_ns () + 1000000000;
+
+    while (HWC_LOAD (done_seq) != seq) {
+        if (now_ns () > timeout)
+            return -ETIMEDOUT;
+        wait_event_done (ctx, 16);
+    }
+
+    return 0;
+}
+
+/* consumer side, event thread only */
+static unsigned int
+queue_length (kms_display_t * kdisp)
+{
+    return HWC_LOAD (&kdisp->queue_tail) - kdisp->queue_head;
+}
+
+static kms_frame_t *
+queued_frame (kms_display_t * kdisp, unsigned int i)
+{
+    return &kdisp->queue[(kdisp->queue_head + i) % MAX_QUEUED_FRAMES];
+}
+
+static void
+dequeue_frame (hwc_context_t * ctx, kms_display_t * kdisp)
+{
+    HWC_STORE (&kdisp->queue_head, kdisp->queue_head + 1);
+    signal_event_done (ctx);
+}
+
+/* producer side, hwc_set() only */
+static void
+queue_frame (hwc_context_t * ctx, int disp, kms_frame_t * frame)
+{
+    kms_display_t *kdisp = &ctx->displays[disp];
+    unsigned tail = kdisp->queue_tail;
+
+    /* the event thread drops the oldest frame of a full queue */
+    while (tail - HWC_LOAD (&kdisp->queue_head) == MAX_QUEUED_FRAMES) {
+        TRACE_SCOPE (TRACE_FRAME, "queue full", frame->seq);
+        wake_event_thread (ctx);
+        wait_event_done (ctx, 16);
+    }
+
+    kdisp->queue[tail % MAX_QUEUED_FRAMES] = *frame;
+    HWC_STORE (&kdisp->queue_tail, tail + 1);
+
+    wake_event_thread (ctx);
+}
+
+static bool
+frame_ready (kms_frame_t * frame)
+{
+    for (unsigned int i = 0; i < frame->num_layers; i++) {
+        if (frame->layers[i].acquire_fence >= 0
+            && sync_wait (frame->layers[i].acquire_fence, 0) < 0)
+            return false;
+    }
+    return true;
+}
+
+static int64_t
+next_vblank (kms_display_t * kdisp, int64_t now)
+{
+    int64_t period = kdisp->vsync_period_ns;
+
+    if (!kdisp->last_vblank_ns || now < kdisp->last_vblank_ns)
+        return now;
+
+    return kdisp->last_vblank_ns +
+        ((now - kdisp->last_vblank_ns) / period + 1) * period;
+}
+
+static int64_t
+latch_deadline (hwc_context_t * ctx, kms_display_t * kdisp, int64_t now)
+{
+    if (!ctx->latch_margin_ns)
+        return now;
+
+    return MAX (now, next_vblank (kdisp, now) - kdisp->latch_margin_ns);
+}
+
+static void
+update_latch_margin (hwc_context_t * ctx, kms_display_t * kdisp,
+    int64_t duration, bool missed)
+{
+    int64_t period = kdisp->vsync_period_ns;
+
+    kdisp->commit_ewma_ns += (duration - kdisp->commit_ewma_ns) / 8;
+
+    if (missed)
+        kdisp->miss_penalty_ns =
+            MIN (kdisp->miss_penalty_ns + period / 16, period / 2);
+    else
+        kdisp->miss_penalty_ns -= kdisp->miss_penalty_ns / 16;
+
+    kdisp->latch_margin_ns =
+        MAX (ctx->latch_margin_ns, 2 * kdisp->commit_ewma_ns) +
+        kdisp->miss_penalty_ns;
+    kdisp->latch_margin_ns = MIN (kdisp->latch_margin_ns, period);
+}
+
+/*
+ * Tell the event thread what to wait for: the latching deadline, or the
+ * fences of the newest frame when the deadline passed and nothing is ready.
+ */
+static int
+latch_wait (hwc_context_t * ctx, int disp, int64_t now, int64_t * deadline,
+    struct pollfd *pfds, int max_fds)
+{
+    kms_display_t *kdisp = &ctx->displays[disp];
+    unsigned int len = queue_length (kdisp);
+    kms_frame_t *frame;
+    int64_t latch;
+    int nfds = 0;
+
+    if (!len || kdisp->flip_pending)
+        return 0;
+
+    latch = latch_deadline (ctx, kdisp, now);
+    if (latch > now) {
+        if (*deadline < 0 || latch < *deadline)
+            *deadline = latch;
+        return 0;
+    }
+
+    for (unsigned int i = 0; i < len; i++) {
+        if (frame_ready (queued_frame (kdisp, i))) {
+            *deadline = now;
+            return 0;
+        }
+    }
+
+    /* the frame waited for, 0 once one is latched */
+    frame = queued_frame (kdisp, len - 1);
+    TRACE_COUNTER (TRACE_FENCE, disp ? "fence wait ext" : "fence wait",
+        frame->seq);
+    for (unsigned int i = 0; i < frame->num_layers && nfds < max_fds; i++) {
+        if (frame->layers[i].acquire_fence < 0)
+            continue;
+        pfds[nfds].fd = frame->layers[i].acquire_fence;
+        pfds[nfds].events = POLLIN;
+        pfds[nfds].revents = 0;
+        nfds++;
+    }
+
+    return nfds;
+}
+
+static void
+latch_display (hwc_context_t * ctx, int disp, int64_t now)
+{
+    kms_display_t *kdisp = &ctx->displays[disp];
+    unsigned int len = queue_length (kdisp);
+    kms_frame_t frame;
+    int64_t start, end, target;
+    int ready = -1;
+
+    /* make room for hwc_set(), the oldest frame would be dropped anyway */
+    if (len == MAX_QUEUED_FRAMES) {
+        close_frame_fences (queued_frame (kdisp, 0));
+        dequeue_frame (ctx, kdisp);
+        len--;
+    }
+
+    /* the page flip in flight calls back with its event */
+    if (!len || kdisp->flip_pending || latch_deadline (ctx, kdisp, now) > now)
+        return;
+
+    for (int i = len - 1; i >= 0 && ready < 0; i--)
+        if (frame_ready (queued_frame (kdisp, i)))
+            ready = i;
+
+    if (ready < 0)
+        return;
+
+    /* superseded frames never reach the screen */
+    for (int i = 0; i < ready; i++) {
+        close_frame_fences (queued_frame (kdisp, 0));
+        dequeue_frame (ctx, kdisp);
+    }
+    frame = *queued_frame (kdisp, 0);
+    dequeue_frame (ctx, kdisp);
+    TRACE_SCOPE (TRACE_FRAME, "latch_display", frame.seq);
+    TRACE_COUNTER (TRACE_FENCE, disp ? "fence wait ext" : "fence wait", 0);
+
+    update_render_scale (ctx, disp, &frame);
+    close_frame_fences (&frame);
+
+    /* committing would turn the crtc back on */
+    if (kdisp->power_mode == HWC_POWER_MODE_OFF) {
+        signal_fences (ctx, disp, frame.seq);
+        return;
+    }
+
+    if (kdisp->power_mode == HWC_POWER_MODE_NORMAL) {
+        bool has_target = false;
+
+        for (unsigned int i = 0; i < frame.num_layers; i++)
+            has_target |= frame.layers[i].type == HWC_FRAMEBUFFER_TARGET;
+        exit_idle (ctx, disp, !has_target);
+    }
+
+    start = now_ns ();
+    target = next_vblank (kdisp, start);
+    commit_frame (ctx, disp, &frame);
+    end = now_ns ();
+    kdisp->last_commit_ns = end;
+
+    kdisp->pending_seq = frame.seq;
+    kdisp->pending_commit_ns = start;
+    kdisp->pending_target_ns = target;
+    kdisp->pending_duration_ns = end - start;
+
+    /* a page flip only tells which vblank it made from its event */
+    if (ctx->latch_margin_ns && !kdisp->flip_pending)
+        update_latch_margin (ctx, kdisp, end - start, end > target);
+}
+
+/*
+ * Color transform
+ *
+ * The color matrix and the transfer curves of a display are offloaded to the
+ * CTM, DEGAMMA_LUT and GAMMA_LUT properties of its crtc. They apply once the
+ * planes are blended, so overlays stay in use while a transform is in effect
+ * instead of SurfaceFlinger compositing the whole screen to apply it.
+ *
+ * HWC1 has no setColorTransform() hook: the transform is read from the
+ * persist.hwc.color.[ext.]{matrix,degamma,gamma} properties at startup and
+ * each time the display is turned on, and handed to the event thread like
+ * power changes.
+ */
+static void
+color_identity (kms_color_t * c)
+{
+    memset (c, 0, sizeof (*c));
+    for (int i = 0; i < 4; i++)
+        c->matrix[i * 5] = 1.0f;
+}
+
+static bool
+is_identity_matrix (const float *matrix)
+{
+    for (int i = 0; i < 16; i++)
+        if (matrix[i] != (i % 5 ? 0.0f : 1.0f))
+            return false;
+    return true;
+}
+
+/* S31.32 sign-magnitude fixed point of the CTM */
+static uint64_t
+to_s31_32 (float v)
+{
+    uint64_t magnitude = (uint64_t) (fabs (v) * 4294967296.0);
+
+    return v < 0 ? magnitude | (1ULL << 63) : magnitude;
+}
+
+static int
+create_lut_blob (int drm_fd, uint32_t size, float exponent, uint32_t * blob)
+{
+    struct drm_color_lut *lut;
+    int ret;
+
+    lut = (struct drm_color_lut *) calloc (size, sizeof (*lut));
+    if (!lut)
+        return -ENOMEM;
+
+    for (uint32_t i = 0; i < size; i++) {
+        float x = size > 1 ? (float) i / (size - 1) : 0.0f;
+        uint16_t v = (uint16_t) lrintf (powf (x, exponent) * 0xffff);
+
+        lut[i].red = lut[i].green = lut[i].blue = v;
+    }
+
+    ret = drmModeCreatePropertyBlob (drm_fd, lut, size * sizeof (*lut), blob);
+    free (lut);
+    return ret;
+}
+
+/* point a color property to a new blob, 0 turns the stage off */
+static int
+set_color_prop (kms_display_t * kdisp, uint32_t prop_id, uint32_t * cur,
+    uint32_t blob)
+{
+    int drm_fd = kdisp->dev->fd;
+    int ret;
+
+    ret = drmModeObjectSetProperty (drm_fd, kdisp->crtc_id,
+        DRM_MODE_OBJECT_CRTC, prop_id, blob);
+    if (ret) {
+        if (blob)
+            drmModeDestroyPropertyBlob (drm_fd, blob);
+        return ret;
+    }
+
+    if (*cur)
+        drmModeDestroyPropertyBlob (drm_fd, *cur);
+    *cur = blob;
+    return 0;
+}
+
+static int
+apply_color_transform (hwc_context_t * ctx, int disp, const kms_color_t * c)
+{
+    kms_display_t *kdisp = &ctx->displays[disp];
+    int drm_fd = kdisp->dev->fd;
+    uint32_t blob = 0;
+    int ret = 0;
+
+    if (kdisp->ctm_prop_id) {
+        if (!is_identity_matrix (c->matrix)) {
+            struct drm_color_ctm ctm;
+
+            /* KMS multiplies column vectors, HWC row vectors */
+            for (int row = 0; row < 3; row++)
+                for (int col = 0; col < 3; col++)
+                    ctm.matrix[row * 3 + col] =
+                        to_s31_32 (c->matrix[col * 4 + row]);
+            ret = drmModeCreatePropertyBlob (drm_fd, &ctm, sizeof (ctm), &blob);
+        }
+        if (!ret)
+            ret = set_color_prop (kdisp, kdisp->ctm_prop_id,
+                &kdisp->color_blobs[0], blob);
+    }
+
+    blob = 0;
+    if (!ret && kdisp->degamma_prop_id) {
+        if (c->degamma > 0)
+            ret = create_lut_blob (drm_fd, kdisp->degamma_size, c->degamma,
+                &blob);
+        if (!ret)
+            ret = set_color_prop (kdisp, kdisp->degamma_prop_id,
+                &kdisp->color_blobs[1], blob);
+    }
+
+    blob = 0;
+    if (!ret && kdisp->gamma_prop_id) {
+        if (c->gamma > 0)
+            ret = create_lut_blob (drm_fd, kdisp->gamma_size, 1.0f / c->gamma,
+                &blob);
+        if (!ret)
+            ret = set_color_prop (kdisp, kdisp->gamma_prop_id,
+                &kdisp->color_blobs[2], blob);
+    }
+
+    if (ret)
+        ALOGE ("Failed to set display %d color transform: %s\n", disp,
+            strerror (-ret));
+
+    return ret;
+}
+
+static void
+handle_color_request (hwc_context_t * ctx, int disp)
+{
+    kms_display_t *kdisp = &ctx->displays[disp];
+    unsigned seq = HWC_LOAD (&kdisp->color_req_seq);
+
+    if (seq == kdisp->color_done_seq)
+        return;
+
+    HWC_STORE (&kdisp->color_ret,
+        apply_color_transform (ctx, disp, &kdisp->color_req));
+    HWC_STORE (&kdisp->color_done_seq, seq);
+    signal_event_done (ctx);
+}
+
+static int
+set_color_transform (hwc_context_t * ctx, int disp, const kms_color_t * c)
+{
+    kms_display_t *kdisp = &ctx->displays[disp];
+    unsigned seq = kdisp->color_req_seq + 1;
+    int ret;
+
+    if (!memcmp (c, &kdisp->color, sizeof (*c)))
+        return 0;
+
+    if (!kdisp->ctm_prop_id && !is_identity_matrix (c->matrix))
+        return -ENOTSUP;
+
+    kdisp->color_req = *c;
+    HWC_STORE (&kdisp->color_req_seq, seq);
+    wake_event_thread (ctx);
+
+    if (wait_request (ctx, &kdisp->color_done_seq, seq)) {
+        ALOGE ("Display %d color transform timed out\n", disp);
+        return -ETIMEDOUT;
+    }
+
+    /* a failed transform is tried again on the next power on */
+    ret = HWC_LOAD (&kdisp->color_ret);
+    if (!ret)
+        kdisp->color = *c;
+
+    return ret;
+}
+
+static void
+load_color_transform (int disp, kms_color_t * c)
+{
+    const char *prefix = disp == HWC_DISPLAY_PRIMARY ? "" : "ext.";
+    char key[PROPERTY_KEY_MAX];
+    char prop_val[PROPERTY_VALUE_MAX];
+    char *p = prop_val, *end;
+    int count = 0;
+
+    color_identity (c);
+
+    snprintf (key, sizeof (key), "persist.hwc.color.%smatrix", prefix);
+    property_get (key, prop_val, "");
+    while (*p && count < 16) {
+        float v = strtof (p, &end);
+
+        if (end == p)
+            break;
+        c->matrix[count++] = v;
+        p = end + strspn (end, ", ");
+    }
+    if (count && count != 16) {
+        ALOGE ("Ignoring %s, 16 values expected\n", key);
+        color_identity (c);
+    }
+    if (c->matrix[12] || c->matrix[13] || c->matrix[14]) {
+        ALOGE ("%s: offsets can't be applied by the crtc\n", key);
+        c->matrix[12] = c->matrix[13] = c->matrix[14] = 0.0f;
+    }
+
+    snprintf (key, sizeof (key), "persist.hwc.color.%sdegamma", prefix);
+    property_get (key, prop_val, "0");
+    c->degamma = strtof (prop_val, NULL);
+
+    snprintf (key, sizeof (key), "persist.hwc.color.%sgamma", prefix);
+    property_get (key, prop_val, "0");
+    c->gamma = strtof (prop_val, NULL);
+}
+
+/*
+ * Power
+ *
+ * The display is powered through the connector DPMS property. The doze modes
+ * keep it on at the idle refresh rate, DOZE_SUSPEND also stops the vblank
+ * events so the CPU can sleep. Powering on restores the last committed frame
+ * right away instead of waiting for SurfaceFlinger to redraw.
+ *
+ * Power changes are requested by hwc_setPowerMode() and carried out by the
+ * event thread, which owns the display state.
+ */
+static int
+apply_power_mode (hwc_context_t * ctx, int disp, int mode)
+{
+    kms_display_t *kdisp = &ctx->displays[disp];
+    int prev = kdisp->power_mode;
+    bool restore = false;
+    int ret = 0;
+
+    if (mode == HWC_POWER_MODE_OFF) {
+        if (queue_length (kdisp)) {
+            unsigned last = queued_frame (kdisp, queue_length (kdisp) - 1)->seq;
+
+            /* the queued frames won't be shown, nothing is worth restoring */
+            while (queue_length (kdisp)) {
+                close_frame_fences (queued_frame (kdisp, 0));
+                dequeue_frame (ctx, kdisp);
+            }
+            kdisp->committed.num_layers = 0;
+            signal_fences (ctx, disp, last);
+        } else if (kdisp->pending_seq) {
+            signal_fences (ctx, disp, kdisp->pending_seq);
+        }
+        kdisp->pending_seq = 0;
+        kdisp->flip_pending = false;
+        kdisp->power_on_ns = 0;
+
+        if (kdisp->dpms_prop_id)
+            ret = drmModeConnectorSetProperty (kdisp->dev->fd,
+                kdisp->con->connector_id, kdisp->dpms_prop_id,
+                DRM_MODE_DPMS_OFF);
+    } else {
+        if (prev == HWC_POWER_MODE_OFF) {
+            /* planes which failed a commit get another chance */
+            for (unsigned int i = 0; i < kdisp->dev->num_planes; i++)
+                HWC_STORE (&kdisp->dev->planes[i].rejected, false);
+
+            kdisp->power_on_ns = now_ns ();
+            if (kdisp->dpms_prop_id)
+                ret = drmModeConnectorSetProperty (kdisp->dev->fd,
+                    kdisp->con->connector_id, kdisp->dpms_prop_id,
+                    DRM_MODE_DPMS_ON);
+            /* program the crtc and every plane again */
+            kdisp->crtc_fb = 0;
+            kdisp->active_planes = 0;
+        }
+
+        /* the restored frame sets the crtc mode picked here */
+        restore = prev == HWC_POWER_MODE_OFF && kdisp->committed.num_layers;
+        if (mode == HWC_POWER_MODE_NORMAL)
+            exit_idle (ctx, disp, !restore);
+        else if (!kdisp->idle)
+            enter_idle (ctx, disp);
+
+        if (restore)
+            commit_frame (ctx, disp, &kdisp->committed);
+    }
+
+    HWC_STORE (&kdisp->power_mode, mode);
+
+    if (!kdisp->vblank_armed && vblank_wanted (kdisp))
+        send_vsync_request (ctx, disp);
+
+    if (ret)
+        ALOGE ("Failed to set display %d power mode %d: %s\n", disp, mode,
+            strerror (errno));
+    return ret;
+}
+
+/* event thread: carry out the pending requests of hwc_setPowerMode() */
+static void
+handle_requests (hwc_context_t * ctx, int disp)
+{
+    kms_display_t *kdisp = &ctx->displays[disp];
+    unsigned seq = HWC_LOAD (&kdisp->power_req_seq);
+
+    if (seq == kdisp->power_done_seq)
+        return;
+
+    HWC_STORE (&kdisp->power_ret,
+        apply_power_mode (ctx, disp, HWC_LOAD (&kdisp->power_req)));
+    HWC_STORE (&kdisp->power_done_seq, seq);
+    signal_event_done (ctx);
+}
+
+static int
+set_power_mode (hwc_context_t * ctx, int disp, int mode)
+{
+    kms_display_t *kdisp = &ctx->displays[disp];
+    unsigned seq = kdisp->power_req_seq + 1;
+
+    HWC_STORE (&kdisp->power_req, mode);
+    HWC_STORE (&kdisp->power_req_seq, seq);
+    wake_event_thread (ctx);
+
+    if (wait_request (ctx, &kdisp->power_done_seq, seq)) {
+        ALOGE ("Display %d power mode %d timed out\n", disp, mode);
+        return -ETIMEDOUT;
+    }
+
+    return HWC_LOAD (&kdisp->power_ret);
+}
+
+static int
+update_display (hwc_context_t * ctx, int disp,
+    hwc_display_contents_1_t * display)
+{
+    kms_display_t *kdisp = &ctx->displays[disp];
+    kms_frame_t frame;
+    int ret;
+
+    if (!is_display_connected (ctx, disp))
+        return 0;
+
+    TRACE_SCOPE (TRACE_FRAME, "update_display", kdisp->frame_seq + 1);
+    kdisp->dev->frames++;
+    ret = build_frame (ctx, disp, display, &frame);
+    if (ret)
+        return ret;
+
+    frame.seq = ++kdisp->frame_seq;
+    frame.prepare_ns = kdisp->prepare_ns;
+    set_release_fences (ctx, disp, display, frame.seq);
+    queue_frame (ctx, disp, &frame);
+
+    if (disp == HWC_DISPLAY_PRIMARY)
+        save_render_scale (kdisp);
+
+    expire_fbs (ctx, kdisp->dev);
+    if (disp == HWC_DISPLAY_PRIMARY && !(frame.seq % RESOURCE_CHECK_FRAMES))
+        check_resources (ctx);
+
+    return 0;
+}
+
+static void *
+event_handler (void *arg)
+{
+    hwc_context_t *ctx = (hwc_context_t *) arg;
+    drmEventContext evctx = {
         .version = DRM_EVENT_CONTEXT_VERSION,
         .vblank_handler = vblank_handler,
-        .page_flip_handler = NULL,
+        .page_flip_handler = page_flip_handler,
     };
-    struct pollfd pfds[1] = {{
-	.fd = drm_fd,
-	.events = POLLIN,
-	.revents = POLLERR
-    }};
+    struct pollfd pfds[1 + MAX_DRM_NODES + MAX_FRAME_LAYERS];
 
     // From documentation for hwc_procs, the vsync event must be handled
     // on a thread with priority HAL_PRIORITY_URGENT_DISPLAY or higher.
@@ -281,271 +3139,487 @@ event_handler (void *arg)
     send_vsync_request (ctx, HWC_DISPLAY_EXTERNAL);
 
     while (1) {
-        int ret = poll (pfds, ARRAY_SIZE (pfds), 60000);
+        int64_t now = now_ns (), deadline = -1;
+        struct timespec timeout = { 60, 0 };
+        nfds_t nfds = 0, wake;
+        char buf[32];
+
+        /* one event source per device, then the wake pipe and the fences */
+        for (unsigned int i = 0; i < ctx->num_devices; i++) {
+            if (ctx->devices[i].fd < 0)
+                continue;
+            pfds[nfds].fd = ctx->devices[i].fd;
+            pfds[nfds++].events = POLLIN;
+        }
+        wake = nfds++;
+        pfds[wake].fd = ctx->wake_fds[0];
+        pfds[wake].events = POLLIN;
+
+        for (int disp = 0; disp < HWC_NUM_PHYSICAL_DISPLAY_TYPES; disp++) {
+            nfds += latch_wait (ctx, disp, now, &deadline, &pfds[nfds],
+                ARRAY_SIZE (pfds) - nfds);
+            idle_wait (ctx, disp, &deadline);
+        }
+
+        if (deadline >= 0 && deadline < now)
+            deadline = now;
+
+        if (deadline >= 0) {
+            timeout.tv_sec = (deadline - now) / 1000000000;
+            timeout.tv_nsec = (deadline - now) % 1000000000;
+        }
+
+        int ret = ppoll (pfds, nfds, &timeout, NULL);
         if (ret < 0) {
+            if (errno == EINTR)
+                continue;
             ALOGE ("Event handler error %d", errno);
             break;
-        } else if (ret == 0) {
+        } else if (ret == 0 && deadline < 0) {
             ALOGI ("Event handler timeout");
             continue;
         }
-        for (int i = 0; i < ret; i++) {
-            if (pfds[i].fd == drm_fd)
-                drmHandleEvent (drm_fd, &evctx);
+
+        for (nfds_t i = 0; i < wake; i++)
+            if (pfds[i].revents & POLLIN)
+                drmHandleEvent (pfds[i].fd, &evctx);
+        if (pfds[wake].revents & POLLIN)
+            while (read (ctx->wake_fds[0], buf, sizeof (buf)) > 0);
+
+        now = now_ns ();
+        for (int disp = 0; disp < HWC_NUM_PHYSICAL_DISPLAY_TYPES; disp++) {
+            handle_color_request (ctx, disp);
+            handle_requests (ctx, disp);
+            latch_display (ctx, disp, now);
+            update_idle (ctx, disp, now);
+
+            if (!ctx->displays[disp].vblank_armed
+                && vblank_wanted (&ctx->displays[disp]))
+                send_vsync_request (ctx, disp);
         }
     }
     return NULL;
 }
 
-static bool
-is_display_connected (hwc_context_t * ctx, int disp)
+/*
+ * Virtual displays, handed over since HWC 1.3, are left to GPU composition:
+ * SurfaceFlinger renders straight into the output buffer. The fences given
+ * to the HAL are closed, except the client target one which becomes the
+ * retire fence of the frame.
+ */
+static void
+set_virtual_display (hwc_display_contents_1_t * display)
+{
+    display->retireFenceFd = -1;
+
+    if (display->outbufAcquireFenceFd >= 0) {
+        close (display->outbufAcquireFenceFd);
+        display->outbufAcquireFenceFd = -1;
+    }
+
+    for (size_t i = 0; i < display->numHwLayers; i++) {
+        hwc_layer_1_t *layer = &display->hwLayers[i];
+
+        if (layer->acquireFenceFd < 0)
+            continue;
+        if (layer->compositionType == HWC_FRAMEBUFFER_TARGET
+            && display->retireFenceFd < 0)
+            display->retireFenceFd = layer->acquireFenceFd;
+        else
+            close (layer->acquireFenceFd);
+        layer->acquireFenceFd = -1;
+    }
+}
+
+static int
+hwc_set (struct hwc_composer_device_1 *dev,
+    size_t numDisplays, hwc_display_contents_1_t ** displays)
+{
+    if (!numDisplays || !displays)
+        return 0;
+
+    hwc_display_contents_1_t *content = displays[HWC_DISPLAY_PRIMARY];
+    int ret = 0, err;
+    hwc_context_t *ctx = to_ctx (dev);
+
+    if (content)
+        ret = update_display (ctx, HWC_DISPLAY_PRIMARY, content);
+
+    content = numDisplays > HWC_DISPLAY_EXTERNAL ?
+        displays[HWC_DISPLAY_EXTERNAL] : NULL;
+    if (content) {
+        err = update_display (ctx, HWC_DISPLAY_EXTERNAL, content);
+        if (!ret)
+            ret = err;
+    }
+
+    /* its fences must not leak whatever happened to the others */
+    content = numDisplays > HWC_DISPLAY_VIRTUAL ?
+        displays[HWC_DISPLAY_VIRTUAL] : NULL;
+    if (content)
+        set_virtual_display (content);
+
+    return ret;
+}
+
+/*
+ * Plane registry
+ *
+ * The planes and the format/modifier pairs they accept are queried once at
+ * init. Planes exposing an IN_FORMATS blob advertise the modifiers for each
+ * format, the others only accept their formats with an implicit layout.
+ */
+static int
+add_plane_format (kms_plane_t * plane, unsigned int *size, uint32_t fourcc,
+    uint64_t modifier)
+{
+    if (plane->count_formats == *size) {
+        unsigned int new_size = *size ? *size * 2 : 16;
+        kms_format_mod_t *formats = (kms_format_mod_t *)
+            realloc (plane->formats, new_size * sizeof (*formats));
+
+        if (!formats)
+            return -ENOMEM;
+        plane->formats = formats;
+        *size = new_size;
+    }
+
+    plane->formats[plane->count_formats].fourcc = fourcc;
+    plane->formats[plane->count_formats].modifier = modifier;
+    plane->count_formats++;
+    return 0;
+}
+
+static int
+parse_in_formats (kms_device_t * dev, kms_plane_t * plane, uint32_t blob_id,
+    unsigned int *size)
 {
-    if ((disp != HWC_DISPLAY_PRIMARY) && (disp != HWC_DISPLAY_EXTERNAL))
-        return false;
+    drmModePropertyBlobPtr blob;
+    struct drm_format_modifier_blob *header;
+    uint32_t *formats;
+    struct drm_format_modifier *modifiers;
 
-    if (!ctx->displays[disp].con)
-        return false;
+    blob = drmModeGetPropertyBlob (dev->fd, blob_id);
+    if (!blob)
+        return -EINVAL;
 
-    if (ctx->displays[disp].con->connection == DRM_MODE_CONNECTED)
-        return true;
+    header = (struct drm_format_modifier_blob *) blob->data;
+    formats = (uint32_t *) ((char *) header + header->formats_offset);
+    modifiers = (struct drm_format_modifier *)
+        ((char *) header + header->modifiers_offset);
 
-    return false;
+    for (uint32_t i = 0; i < header->count_modifiers; i++) {
+        for (uint32_t j = 0; j < 64; j++) {
+            uint32_t index = modifiers[i].offset + j;
+
+            if (!(modifiers[i].formats & (1ULL << j)))
+                continue;
+            if (index >= header->count_formats)
+                break;
+            if (add_plane_format (plane, size, formats[index],
+                    modifiers[i].modifier)) {
+                drmModeFreePropertyBlob (blob);
+                return -ENOMEM;
+            }
+        }
+    }
+
+    drmModeFreePropertyBlob (blob);
+    return 0;
 }
 
-static bool
-set_zorder (hwc_context_t * ctx, int plane_id, int zorder)
+static uint32_t
+get_in_formats_blob (kms_device_t * dev, uint32_t plane_id)
 {
-    drmModeObjectPropertiesPtr properties = NULL;
-    drmModePropertyPtr property = NULL;
-    int i, ret;
+    drmModeObjectPropertiesPtr properties;
+    uint32_t blob_id = 0;
 
     properties =
-        drmModeObjectGetProperties (ctx->drm_fd, plane_id,
+        drmModeObjectGetProperties (dev->fd, plane_id,
         DRM_MODE_OBJECT_PLANE);
-
     if (!properties)
-        return false;
+        return 0;
+
+    for (uint32_t i = 0; i < properties->count_props && !blob_id; i++) {
+        drmModePropertyPtr property =
+            drmModeGetProperty (dev->fd, properties->props[i]);
 
-    for (i = 0; i < (int) properties->count_props; ++i) {
-        property = drmModeGetProperty (ctx->drm_fd, properties->props[i]);
         if (!property)
             continue;
-        if (strcmp (property->name, "zpos") == 0)
-            break;
+        if (strcmp (property->name, "IN_FORMATS") == 0)
+            blob_id = properties->prop_values[i];
         drmModeFreeProperty (property);
     }
 
-    if (i == (int) properties->count_props)
-        goto free_properties;
-
-    ret =
-        drmModeObjectSetProperty (ctx->drm_fd, plane_id,
-        DRM_MODE_OBJECT_PLANE, property->prop_id, zorder);
-    drmModeFreeProperty (property);
-
-free_properties:
     drmModeFreeObjectProperties (properties);
-    return ! !ret;
+    return blob_id;
 }
 
-static void set_release_fences (hwc_context_t * ctx, int disp,
-    hwc_display_contents_1_t * display)
+static void
+destroy_planes (kms_device_t * dev)
 {
-    kms_display_t *kdisp = &ctx->displays[disp];
-    int fence;
-
-    fence = sw_sync_fence_create(kdisp->timeline, "Fence", kdisp->signaled_fences + FENCE_DELAY);
-
-    for (size_t i = 0; i < display->numHwLayers; i++) {
-        hwc_layer_1_t *target = &display->hwLayers[i];
-	if (target->compositionType == HWC_OVERLAY)
-	    target->releaseFenceFd = dup(fence);
-    }
-
-    display->retireFenceFd = fence;
+    for (unsigned int i = 0; i < dev->num_planes; i++)
+        free (dev->planes[i].formats);
+    memset (dev->planes, 0, sizeof (dev->planes));
+    dev->num_planes = 0;
 }
 
 static int
-update_display (hwc_context_t * ctx, int disp,
-    hwc_display_contents_1_t * display)
+init_planes (kms_device_t * dev)
 {
-    int ret = 0, zorder = 1;
-    uint32_t width = 0, height = 0;
-    uint32_t fb = 0;
-    uint32_t bo[4] = { 0 };
-    uint32_t pitch[4] = { 0 };
-    uint32_t offset[4] = { 0 };
-    hwc_layer_1_t *target = NULL;
+    drmModePlaneResPtr plane_res;
+    uint64_t cap = 0;
 
-    kms_display_t *kdisp = &ctx->displays[disp];
+    if (!drmGetCap (dev->fd, DRM_CAP_ADDFB2_MODIFIERS, &cap))
+        dev->fb_modifiers = ! !cap;
 
-    if (!is_display_connected (ctx, disp))
-        return 0;
+    /* primary planes are listed too, for the render scaling */
+    drmSetClientCap (dev->fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1);
 
-    for (size_t i = 0; i < display->numHwLayers; i++) {
-        hwc_layer_1_t *target = &display->hwLayers[i];
+    plane_res = drmModeGetPlaneResources (dev->fd);
+    if (!plane_res) {
+        ALOGE ("Failed to get plane resources: %s\n", strerror (errno));
+        return -EINVAL;
+    }
 
-        if (!target)
-            continue;
+    for (uint32_t i = 0; i < plane_res->count_planes; i++) {
+        kms_plane_t *kplane = &dev->planes[dev->num_planes];
+        uint64_t type = DRM_PLANE_TYPE_OVERLAY;
+        unsigned int size = 0;
+        drmModePlanePtr plane;
+        uint32_t blob_id;
 
-        private_handle_t const *hnd =
-            reinterpret_cast < private_handle_t const *>(target->handle);
+        if (dev->num_planes == MAX_PLANES) {
+            ALOGI ("Only the first %d planes are used\n", MAX_PLANES);
+            break;
+        }
 
-        if (!hnd)
+        plane = drmModeGetPlane (dev->fd, plane_res->planes[i]);
+        if (!plane)
             continue;
 
-        if ((display->hwLayers[i].compositionType != HWC_FRAMEBUFFER_TARGET)
-            && (display->hwLayers[i].compositionType != HWC_OVERLAY))
+        get_prop_id (dev->fd, plane->plane_id, DRM_MODE_OBJECT_PLANE, "type",
+            &type);
+        if (type != DRM_PLANE_TYPE_OVERLAY) {
+            for (int pipe = 0; pipe < MAX_CRTCS; pipe++)
+                if (type == DRM_PLANE_TYPE_PRIMARY
+                    && (plane->possible_crtcs & (1U << pipe))
+                    && !dev->primary_planes[pipe])
+                    dev->primary_planes[pipe] = plane->plane_id;
+            drmModeFreePlane (plane);
             continue;
+        }
 
-	/* wait for sync */
-	if (target->acquireFenceFd >= 0) {
-            int ret = sync_wait (target->acquireFenceFd, 1000);
-            if (ret < 0) {
-                ALOGE ("%s: sync_wait error!! error no = %d err str = %s",
-                    __FUNCTION__, errno, strerror (errno));
-            }
-            close (target->acquireFenceFd);
-            target->acquireFenceFd = -1;
+        kplane->plane_id = plane->plane_id;
+        kplane->possible_crtcs = plane->possible_crtcs;
+
+        blob_id = get_in_formats_blob (dev, plane->plane_id);
+        if (!blob_id || parse_in_formats (dev, kplane, blob_id, &size)) {
+            kplane->count_formats = 0;
+            for (uint32_t j = 0; j < plane->count_formats; j++)
+                add_plane_format (kplane, &size, plane->formats[j],
+                    DRM_FORMAT_MOD_INVALID);
         }
 
-        unsigned int fourcc = hnd_to_fourcc (hnd);
+        ALOGI ("%s plane %d: %d format/modifier pairs%s\n", dev->path,
+            kplane->plane_id, kplane->count_formats,
+            blob_id ? " (IN_FORMATS)" : "");
 
-        if (!fourcc)
-            return -EINVAL;
+        drmModeFreePlane (plane);
+        dev->num_planes++;
+    }
 
-        if (!(hnd->flags & private_handle_t::PRIV_FLAGS_USES_ION)) {
-            AERR ("private_handle_t isn't using ION, hnd->flags %d",
-                hnd->flags);
-            return -EINVAL;
-        }
+    drmModeFreePlaneResources (plane_res);
+    return 0;
+}
 
-        width = hnd->width;
-        height = hnd->height;
+static bool
+plane_supports (kms_plane_t * plane, uint32_t fourcc, uint64_t modifier)
+{
+    for (unsigned int i = 0; i < plane->count_formats; i++) {
+        if (plane->formats[i].fourcc != fourcc)
+            continue;
+        /* an implicit layout is accepted by any entry for the format, and
+         * linear by the entries of planes without IN_FORMATS */
+        if (modifier == DRM_FORMAT_MOD_INVALID
+            || plane->formats[i].modifier == modifier
+            || (modifier == DRM_FORMAT_MOD_LINEAR
+                && plane->formats[i].modifier == DRM_FORMAT_MOD_INVALID))
+            return true;
+    }
+    return false;
+}
 
-        ret = drmPrimeFDToHandle (ctx->drm_fd, hnd->share_fd, &bo[0]);
-        if (ret) {
-            ALOGE ("Failed to get fd for DUMB buffer %s", strerror (errno));
-            return ret;
-        }
+static bool
+plane_usable (kms_display_t * d, unsigned int i, uint32_t fourcc,
+    uint64_t modifier)
+{
+    kms_plane_t *plane = &d->dev->planes[i];
 
-	if (fourcc == DRM_FORMAT_NV12) {
-	    bo[1] = bo[0];
-	    pitch[0] = width;
-	    pitch[1] = width;
-	    offset[1] = width * height;
-	} else {
-	    pitch[0] = width * 4;   //stride
-	}
+    if (!(plane->possible_crtcs & (1 << d->pipe)))
+        return false;
 
-        ret =
-            drmModeAddFB2 (ctx->drm_fd, width, height, fourcc, bo, pitch,
-            offset, &fb, 0);
-        if (ret) {
-            ALOGE ("cannot create framebuffer (%d): %s\n", errno, strerror (errno));
-            return ret;
-        }
+    if (d->dev->used_planes & (1ULL << i))
+        return false;
 
-        if (display->hwLayers[i].compositionType == HWC_FRAMEBUFFER_TARGET) {
-            drmModeSetCrtc (ctx->drm_fd, kdisp->crtc_id, fb, 0, 0,
-                &kdisp->con->connector_id, 1, kdisp->mode);
-            zorder++;
-        }
+    if (HWC_LOAD (&plane->rejected))
+        return false;
 
-        if (display->hwLayers[i].compositionType == HWC_OVERLAY) {
-            int plane_id = hnd->plane_id;
+    return plane_supports (plane, fourcc, modifier);
+}
 
-            set_zorder (ctx, plane_id, zorder++);
+/* take a free plane for the format, the prefer plane if it fits */
+static int
+find_plane_format (hwc_context_t * ctx, int disp, uint32_t fourcc,
+    uint64_t modifier, uint32_t prefer)
+{
+    kms_display_t *d = &ctx->displays[disp];
+    kms_device_t *dev = d->dev;
+    unsigned int i = prefer ? plane_index (dev, prefer) : MAX_PLANES;
 
-            drmModeSetPlane (ctx->drm_fd, plane_id, kdisp->crtc_id, fb, 0,
-                target->displayFrame.left,
-                target->displayFrame.top,
-                target->displayFrame.right - target->displayFrame.left,
-                target->displayFrame.bottom - target->displayFrame.top,
-                target->sourceCrop.left << 16,
-                target->sourceCrop.top << 16,
-                (target->sourceCrop.right - target->sourceCrop.left) << 16,
-                (target->sourceCrop.bottom - target->sourceCrop.top) << 16);
+    if (i < dev->num_planes && plane_usable (d, i, fourcc, modifier)) {
+        dev->used_planes |= 1ULL << i;
+        return prefer;
+    }
 
+    for (i = 0; i < dev->num_planes; i++) {
+        if (plane_usable (d, i, fourcc, modifier)) {
+            dev->used_planes |= 1ULL << i;
+            return dev->planes[i].plane_id;
         }
     }
 
-    set_release_fences (ctx, disp, display);
     return 0;
 }
 
-static int
-hwc_set (struct hwc_composer_device_1 *dev,
-    size_t numDisplays, hwc_display_contents_1_t ** displays)
+/*
+ * Plane assignment hysteresis
+ *
+ * Moving a layer between a plane and the GPU costs a full composition and
+ * may glitch, so the assignment of the previous frame is kept when it still
+ * works: a layer stays on its plane, and a layer composited by the GPU only
+ * gets a plane once it was eligible for ctx->promote_frames frames in a row,
+ * or right away when it covers ctx->promote_percent of the display. A layer
+ * which can't keep its plane is demoted immediately. Layers are matched with
+ * the previous frame by index, and by geometry or buffer.
+ */
+static kms_layer_plane_t *
+previous_assignment (kms_display_t * d, size_t i, hwc_layer_1_t * layer)
 {
-    if (!numDisplays || !displays)
-        return 0;
+    kms_layer_plane_t *prev;
 
-    hwc_display_contents_1_t *content = displays[HWC_DISPLAY_PRIMARY];
-    int ret = 0;
-    hwc_context_t *ctx = to_ctx (dev);
-    size_t i = 0;
+    if (i >= d->num_assigned)
+        return NULL;
 
-    if (content) {
-        ret = update_display (ctx, HWC_DISPLAY_PRIMARY, content);
-        if (ret)
-            return ret;
-    }
+    prev = &d->assigned[i];
+    if (prev->handle != layer->handle
+        && memcmp (&prev->displayFrame, &layer->displayFrame,
+            sizeof (hwc_rect_t)))
+        return NULL;
 
-    content = displays[HWC_DISPLAY_EXTERNAL];
-    if (content)
-        return update_display (ctx, HWC_DISPLAY_EXTERNAL, content);
+    return prev;
+}
 
-    return ret;
+static bool
+promotion_allowed (hwc_context_t * ctx, kms_display_t * d,
+    kms_layer_plane_t * prev, hwc_layer_1_t * layer)
+{
+    const hwc_rect_t & r = layer->displayFrame;
+    int64_t area = (int64_t) (r.right - r.left) * (r.bottom - r.top);
+    int64_t screen = (int64_t) d->width * d->height;
+
+    /* new layers have no history to keep */
+    if (!prev)
+        return true;
+
+    if (prev->eligible_frames + 1 >= ctx->promote_frames)
+        return true;
+
+    return area * 100 >= screen * ctx->promote_percent;
 }
 
 static int
-find_plane (hwc_context_t * ctx, int disp, private_handle_t * hnd)
+find_plane (hwc_context_t * ctx, int disp, size_t i, hwc_layer_1_t * layer,
+    kms_layer_plane_t * next)
 {
-    unsigned int i, j, ret = 0;
-    drmModePlaneResPtr plane_res;
-    int drm_fd = ctx->drm_fd;
+    kms_display_t *d = &ctx->displays[disp];
+    private_handle_t *hnd = (private_handle_t *) layer->handle;
+    kms_layer_plane_t *prev = previous_assignment (d, i, layer);
     unsigned int fourcc = hnd_to_fourcc (hnd);
+    int plane_id;
+    TRACE_SCOPE (TRACE_IMPORT, "find_plane", -1);
 
     if (!fourcc) {
 	 ALOGI("no plane fourcc for handle %08x\n", intptr_t(hnd));
-        return ret;
+        return 0;
     }
 
-    plane_res = drmModeGetPlaneResources (drm_fd);
+    plane_id = find_plane_format (ctx, disp, fourcc, hnd_to_modifier (hnd),
+        prev ? prev->plane_id : 0);
 
-    for (i = 0; i < plane_res->count_planes && !ret; i++) {
-        drmModePlanePtr plane;
+    /* keep a GPU composited layer there until it proved stable */
+    if (plane_id && prev && !prev->plane_id
+        && !promotion_allowed (ctx, d, prev, layer)) {
+        d->dev->used_planes &= ~(1ULL << plane_index (d->dev, plane_id));
+        next->eligible_frames = prev->eligible_frames + 1;
+        return 0;
+    }
 
-        plane = drmModeGetPlane (drm_fd, plane_res->planes[i]);
+    return plane_id;
+}
 
-        if (!plane)
-            continue;
+/*
+ * Look for the topmost run of at least two static layers starting at layer
+ * top and give it a plane. Returns the number of layers taken by the cache.
+ */
+static size_t
+prepare_static_cache (hwc_context_t * ctx, int disp,
+    hwc_display_contents_1_t * content, int top)
+{
+    kms_display_t *d = &ctx->displays[disp];
+    kms_static_cache_t *cache = &d->cache;
+    hwc_rect_t bbox;
+    int first = top;
 
-        if (!(plane->possible_crtcs & (1 << disp))) {
-            drmModeFreePlane (plane);
-            continue;
-        }
+    if (cache->count || !is_cacheable_layer (ctx, disp, content, top))
+        return 0;
 
-        if (ctx->used_planes & (1 << i)) {
-            drmModeFreePlane (plane);
-            continue;
-        }
+    while (first > 0 && is_cacheable_layer (ctx, disp, content, first - 1))
+        first--;
 
-        for (j = 0; j < plane->count_formats && !ret; j++) {
-	     if (plane->formats[j] == fourcc) {
-                ret = plane->plane_id;
-                hnd->plane_id = plane->plane_id;
-                ctx->used_planes |= 1 << i;
-            }
-        }
+    if (top - first + 1 < 2)
+        return 0;
 
-        drmModeFreePlane (plane);
+    bbox = content->hwLayers[first].displayFrame;
+    for (int i = first + 1; i <= top; i++) {
+        const hwc_rect_t & r = content->hwLayers[i].displayFrame;
+
+        bbox.left = MIN (bbox.left, r.left);
+        bbox.top = MIN (bbox.top, r.top);
+        bbox.right = MAX (bbox.right, r.right);
+        bbox.bottom = MAX (bbox.bottom, r.bottom);
     }
+    bbox.left = MAX (bbox.left, 0);
+    bbox.top = MAX (bbox.top, 0);
+    bbox.right = MIN (bbox.right, d->width);
+    bbox.bottom = MIN (bbox.bottom, d->height);
+    if (bbox.right <= bbox.left || bbox.bottom <= bbox.top)
+        return 0;
 
-    drmModeFreePlaneResources (plane_res);
+    cache->plane_id =
+        find_plane_format (ctx, disp, DRM_FORMAT_ARGB8888,
+        DRM_FORMAT_MOD_INVALID, 0);
+    if (!cache->plane_id)
+        return 0;
 
-    return ret;
+    cache->first = first;
+    cache->count = top - first + 1;
+    cache->bbox = bbox;
+
+    for (int i = first; i <= top; i++)
+        content->hwLayers[i].compositionType = HWC_OVERLAY;
+
+    return cache->count;
 }
 
 static int
@@ -553,15 +3627,33 @@ prepare_display (hwc_context_t * ctx, int disp,
     hwc_display_contents_1_t * content)
 {
     kms_display_t *d = &ctx->displays[disp];
-    bool target_framebuffer = false;
+    kms_layer_plane_t next[MAX_TRACKED_LAYERS];
+    size_t count = MIN (content->numHwLayers, (size_t) MAX_TRACKED_LAYERS);
+    /* overlays would need scaling planes too, the GPU takes everything */
+    bool target_framebuffer = d->render_scale != 100;
 
     if (!is_display_connected (ctx, disp))
         return 0;
 
+    d->prepare_ns = now_ns ();
+    memset (next, 0, sizeof (next));
+    for (size_t i = 0; i < count; i++) {
+        next[i].handle = content->hwLayers[i].handle;
+        next[i].displayFrame = content->hwLayers[i].displayFrame;
+    }
+
+    if (TRACE_ENABLED (TRACE_LAYERS))
+        for (size_t i = 0; i < content->numHwLayers; i++)
+            dump_layer (&content->hwLayers[i]);
+
+    track_static_layers (ctx, disp, content);
+    d->cache.count = 0;
+
     for (int i = content->numHwLayers - 1; i >= 0; i--) {
         hwc_layer_1_t & layer = content->hwLayers[i];
         private_handle_t *hnd = (private_handle_t *) layer.handle;
         int plane_id;
+        size_t cached;
 
         if (layer.flags & HWC_SKIP_LAYER)
             continue;
@@ -574,9 +3666,20 @@ prepare_display (hwc_context_t * ctx, int disp,
             continue;
         }
 
-        plane_id = find_plane (ctx, disp, hnd);
+        /* layers past the tracked ones have nowhere to keep their plane */
+        plane_id = 0;
+        if (i < (int) count && can_import_buffer (ctx, disp, hnd))
+            plane_id = find_plane (ctx, disp, i, &layer, &next[i]);
         if (plane_id) {
             layer.compositionType = HWC_OVERLAY;
+            next[i].plane_id = plane_id;
+            continue;
+        }
+
+        /* the CPU copy only takes what the planes left over */
+        cached = prepare_static_cache (ctx, disp, content, i);
+        if (cached) {
+            i -= cached - 1;
             continue;
         }
 
@@ -584,6 +3687,9 @@ prepare_display (hwc_context_t * ctx, int disp,
         target_framebuffer = true;
     }
 
+    memcpy (d->assigned, next, sizeof (next));
+    d->num_assigned = count;
+
     return 0;
 }
 
@@ -596,9 +3702,13 @@ hwc_prepare (struct hwc_composer_device_1 *dev,
 
     hwc_display_contents_1_t *content = displays[HWC_DISPLAY_PRIMARY];
     hwc_context_t *ctx = to_ctx (dev);
+    kms_device_t *primary_dev = ctx->displays[HWC_DISPLAY_PRIMARY].dev;
     int ret = 0;
+    TRACE_SCOPE (TRACE_FRAME, "hwc_prepare",
+        ctx->displays[HWC_DISPLAY_PRIMARY].frame_seq + 1);
 
-    ctx->used_planes = 0;
+    for (unsigned int i = 0; i < ctx->num_devices; i++)
+        ctx->devices[i].used_planes = 0;
 
     if (content) {
         ret = prepare_display (ctx, HWC_DISPLAY_PRIMARY, content);
@@ -607,9 +3717,11 @@ hwc_prepare (struct hwc_composer_device_1 *dev,
             return ret;
     }
 
-    /* do not use planes for external display */
-    ctx->used_planes = -1;
-    content = displays[HWC_DISPLAY_EXTERNAL];
+    /* do not use the planes of the primary device for external display */
+    if (primary_dev)
+        primary_dev->used_planes = -1;
+    content = numDisplays > HWC_DISPLAY_EXTERNAL ?
+        displays[HWC_DISPLAY_EXTERNAL] : NULL;
     if (content)
         ret = prepare_display (ctx, HWC_DISPLAY_EXTERNAL, content);
 
@@ -627,7 +3739,10 @@ hwc_eventControl (struct hwc_composer_device_1 *dev, int disp,
 
     switch (event) {
         case HWC_EVENT_VSYNC:
-            ctx->displays[disp].vsync_on = enabled;
+            HWC_STORE (&ctx->displays[disp].vsync_on, enabled);
+            /* leave the idle refresh rate before the first vsync */
+            if (enabled)
+                wake_event_thread (ctx);
             return 0;
         default:
             return -EINVAL;
@@ -638,14 +3753,16 @@ static int
 hwc_query (struct hwc_composer_device_1 *dev, int what, int *value)
 {
     hwc_context_t *ctx = to_ctx (dev);
-    int refreshRate = 60;
 
     switch (what) {
         case HWC_BACKGROUND_LAYER_SUPPORTED:
             value[0] = 0;
 	    break;
         case HWC_VSYNC_PERIOD:
-            value[0] = 1000000000 / refreshRate;
+            value[0] = 1000000000 / 60;
+            if (is_display_connected (ctx, HWC_DISPLAY_PRIMARY))
+                value[0] =
+                    mode_vsync_period (ctx->displays[HWC_DISPLAY_PRIMARY].mode);
             break;
         case HWC_DISPLAY_TYPES_SUPPORTED:
             if (is_display_connected (ctx, HWC_DISPLAY_PRIMARY))
@@ -665,7 +3782,7 @@ hwc_registerProcs (struct hwc_composer_device_1 *dev,
 {
     hwc_context_t *ctx = to_ctx (dev);
 
-    ctx->cb_procs = procs;
+    HWC_STORE (&ctx->cb_procs, procs);
 }
 
 static int
@@ -701,24 +3818,24 @@ hwc_getDisplayAttributes (struct hwc_composer_device_1 *dev, int disp,
     for (int i = 0; attributes[i] != HWC_DISPLAY_NO_ATTRIBUTE; i++) {
         switch (attributes[i]) {
             case HWC_DISPLAY_VSYNC_PERIOD:
-                values[i] = 1000000000 / 60;
+                /* always the full rate, even while idle */
+                values[i] = mode_vsync_period (d->mode);
                 break;
             case HWC_DISPLAY_WIDTH:
-                values[i] = d->mode->hdisplay;
+                values[i] = d->width;
                 break;
             case HWC_DISPLAY_HEIGHT:
-                values[i] = d->mode->vdisplay;
+                values[i] = d->height;
                 break;
             case HWC_DISPLAY_DPI_X:
                 values[i] = 0;
                 if (d->con->mmWidth)
-                    values[i] = (d->mode->hdisplay * 25400) / d->con->mmWidth;
+                    values[i] = (d->width * 25400) / d->con->mmWidth;
                 break;
             case HWC_DISPLAY_DPI_Y:
                 values[i] = 0;
                 if (d->con->mmHeight)
-                    values[i] =
-                        (d->mode->vdisplay * 25400) / d->con->mmHeight;
+                    values[i] = (d->height * 25400) / d->con->mmHeight;
                 break;
             default:
                 ALOGE ("unknown display attribute %u\n", *attributes);
@@ -730,24 +3847,128 @@ hwc_getDisplayAttributes (struct hwc_composer_device_1 *dev, int disp,
 }
 
 static int
-hwc_blank (struct hwc_composer_device_1 *dev, int disp, int blank)
+hwc_setPowerMode (struct hwc_composer_device_1 *dev, int disp, int mode)
 {
     hwc_context_t *ctx = to_ctx (dev);
-    int arg, ret;
+    kms_color_t color;
 
     if (!is_display_connected (ctx, disp))
         return -EINVAL;
 
-    arg = blank ? FB_BLANK_POWERDOWN : FB_BLANK_UNBLANK;
+    switch (mode) {
+        case HWC_POWER_MODE_DOZE:
+        case HWC_POWER_MODE_NORMAL:
+        case HWC_POWER_MODE_DOZE_SUSPEND:
+            /* pick up a new calibration before the screen lights up */
+            load_color_transform (disp, &color);
+            if (set_color_transform (ctx, disp, &color) == -ENOTSUP)
+                ALOGE ("Display %d can't apply a color matrix\n", disp);
+            return set_power_mode (ctx, disp, mode);
+        case HWC_POWER_MODE_OFF:
+            return set_power_mode (ctx, disp, mode);
+        default:
+            return -EINVAL;
+    }
+}
+
+static int
+hwc_getActiveConfig (struct hwc_composer_device_1 *dev, int disp)
+{
+    hwc_context_t *ctx = to_ctx (dev);
 
-    ret = ioctl (ctx->drm_fd, FBIOBLANK, arg);
-    return ret;
+    if (!is_display_connected (ctx, disp))
+        return -1;
+
+    return HWC_DEFAULT_CONFIG;
+}
+
+static int
+hwc_setActiveConfig (struct hwc_composer_device_1 *dev, int disp, int index)
+{
+    hwc_context_t *ctx = to_ctx (dev);
+
+    if (!is_display_connected (ctx, disp) || index != HWC_DEFAULT_CONFIG)
+        return -EINVAL;
+
+    return 0;
 }
 
 static void
 hwc_dump (struct hwc_composer_device_1 *dev, char *buff, int buff_len)
 {
-    ALOGD ("%s", __func__);
+    hwc_context_t *ctx = to_ctx (dev);
+    int len = 0;
+
+    len += snprintf (buff, buff_len,
+        "Startup: device probe %lld us, first frame %lld us\n",
+        (long long) ctx->probe_ns / 1000,
+        (long long) HWC_LOAD (&ctx->first_frame_ns) / 1000);
+
+    for (unsigned int i = 0; i < ctx->num_devices && len < buff_len; i++) {
+        kms_device_t *kdev = &ctx->devices[i];
+
+        if (kdev->fd < 0)
+            continue;
+        len += snprintf (buff + len, buff_len - len,
+            "Device %s: fd %d, crtcs 0x%x, %u planes\n", kdev->path,
+            kdev->fd, kdev->used_crtcs, kdev->num_planes);
+        if (len >= buff_len)
+            continue;
+        len += snprintf (buff + len, buff_len - len,
+            "  fbs: %u cached (%llu created, %llu removed), "
+            "GEM handles: %u open (%llu opened, %llu closed)\n",
+            HWC_LOAD (&kdev->num_fbs),
+            (unsigned long long) HWC_LOAD (&kdev->fbs_created),
+            (unsigned long long) HWC_LOAD (&kdev->fbs_removed),
+            HWC_LOAD (&kdev->num_gems),
+            (unsigned long long) HWC_LOAD (&kdev->gems_opened),
+            (unsigned long long) HWC_LOAD (&kdev->gems_closed));
+    }
+
+    if (len < buff_len)
+        len += snprintf (buff + len, buff_len - len, "Open fds: %d\n",
+            count_fds ());
+
+    for (int disp = 0; disp < HWC_NUM_PHYSICAL_DISPLAY_TYPES; disp++) {
+        kms_display_t *d = &ctx->displays[disp];
+
+        if (!is_display_connected (ctx, disp) || len >= buff_len)
+            continue;
+
+        len += snprintf (buff + len, buff_len - len,
+            "Display %d: %s pipe %d, power mode %d, last screen on %lld us\n",
+            disp, d->dev->path, d->pipe, HWC_LOAD (&d->power_mode),
+            (long long) HWC_LOAD (&d->screen_on_ns) / 1000);
+        if (len >= buff_len)
+            continue;
+        len += snprintf (buff + len, buff_len - len,
+            "  color: ctm %s, degamma %.2f, gamma %.2f\n",
+            is_identity_matrix (d->color.matrix) ? "identity" : "set",
+            d->color.degamma, d->color.gamma);
+        if (len >= buff_len)
+            continue;
+        len += snprintf (buff + len, buff_len - len,
+            "  render: %dx%d (%d%%, next start %d%%), client %lld us\n",
+            d->width, d->height, d->render_scale,
+            HWC_LOAD (&d->render_scale_next),
+            (long long) HWC_LOAD (&d->client_ewma_ns) / 1000);
+    }
+
+    init_trace ();
+    if (len < buff_len)
+        dump_trace (buff + len, buff_len - len);
+}
+
+static void
+close_device (kms_device_t * dev)
+{
+    if (dev->fd >= 0)
+        destroy_fbs (dev);
+    destroy_planes (dev);
+    free_snapshot (&dev->snap);
+    if (dev->fd >= 0)
+        drmClose (dev->fd);
+    dev->fd = -1;
 }
 
 static int
@@ -758,24 +3979,78 @@ hwc_device_close (struct hw_device_t *dev)
     if (!ctx)
         return 0;
 
-    destroy_display (ctx->drm_fd, &ctx->displays[HWC_DISPLAY_PRIMARY]);
-    destroy_display (ctx->drm_fd, &ctx->displays[HWC_DISPLAY_EXTERNAL]);
+    destroy_display (&ctx->displays[HWC_DISPLAY_PRIMARY]);
+    destroy_display (&ctx->displays[HWC_DISPLAY_EXTERNAL]);
 
-    drmClose (ctx->drm_fd);
+    for (unsigned int i = 0; i < ctx->num_devices; i++)
+        close_device (&ctx->devices[i]);
+    if (ctx->gralloc_fd >= 0)
+        close (ctx->gralloc_fd);
     free (ctx);
 
     return 0;
 }
 
+/*
+ * gralloc gets a file of its own on the primary device: GEM handles belong
+ * to a file, and the HWC closes the ones of the buffers it stops showing,
+ * which would pull them from under gralloc on a shared fd.
+ */
 static void
-init_gralloc (int drm_fd)
+init_gralloc (hwc_context_t * ctx, kms_device_t * dev)
 {
     hw_module_t *pmodule = NULL;
     private_module_t *m = NULL;
     hw_get_module (GRALLOC_HARDWARE_MODULE_ID,
         (const hw_module_t **) &pmodule);
     m = reinterpret_cast < private_module_t * >(pmodule);
-    m->drm_fd = drm_fd;
+
+    if (dev->path[0])
+        ctx->gralloc_fd = open (dev->path, O_RDWR | O_CLOEXEC);
+
+    /* PRIME export needs an authenticated file before Linux 5.2 */
+    if (ctx->gralloc_fd >= 0) {
+        drm_magic_t magic;
+
+        if (drmGetMagic (ctx->gralloc_fd, &magic)
+            || drmAuthMagic (dev->fd, magic)) {
+            ALOGE ("Failed to authenticate the gralloc file: %s",
+                strerror (errno));
+            close (ctx->gralloc_fd);
+            ctx->gralloc_fd = -1;
+        }
+    }
+
+    if (ctx->gralloc_fd < 0) {
+        ALOGE ("Failed to open %s for gralloc, GEM handles are left open",
+            dev->path);
+        dev->shared_handles = true;
+    }
+    m->drm_fd = ctx->gralloc_fd >= 0 ? ctx->gralloc_fd : dev->fd;
+}
+
+/* "card1:HDMIA" puts a display on the given device, "HDMIA" on any */
+static kms_device_t *
+hwc_get_device (hwc_context_t * ctx, char **conn_str)
+{
+    char *sep = strchr (*conn_str, ':');
+    char *name = *conn_str;
+
+    if (!sep)
+        return NULL;
+
+    *sep = '\0';
+    *conn_str = sep + 1;
+
+    for (unsigned int i = 0; i < ctx->num_devices; i++) {
+        const char *base = strrchr (ctx->devices[i].path, '/');
+
+        if (!strcmp (name, base ? base + 1 : ctx->devices[i].path))
+            return &ctx->devices[i];
+    }
+
+    ALOGE ("Unknown device (%s), will use default\n", name);
+    return NULL;
 }
 
 static int
@@ -812,33 +4087,51 @@ hwc_device_open (const struct hw_module_t *module, const char *name,
     hwc_context_t *ctx;
     drmModeResPtr resources;
     drmModePlaneResPtr planes;
+    kms_device_t *kdev;
     int err = 0;
     int ret = 0;
     int drm_fd = 0;
     int connector;
-    char prop_val[PROPERTY_VALUE_MAX];
+    char prop_val[PROPERTY_VALUE_MAX], *conn_str;
 
     if (strcmp (name, HWC_HARDWARE_COMPOSER))
         return -EINVAL;
     ctx = (hwc_context_t *) calloc (1, sizeof (*ctx));
+    ctx->open_ns = now_ns ();
+    init_trace ();
 
     /* Initialize the procs */
     ctx->device.common.tag = HARDWARE_DEVICE_TAG;
-    ctx->device.common.version = HWC_DEVICE_API_VERSION_1_1;
+    ctx->device.common.version = HWC_DEVICE_API_VERSION_1_4;
     ctx->device.common.module = (struct hw_module_t *) module;
     ctx->device.common.close = hwc_device_close;
 
     ctx->device.prepare = hwc_prepare;
     ctx->device.set = hwc_set;
     ctx->device.eventControl = hwc_eventControl;
-    ctx->device.blank = hwc_blank;
+    ctx->device.setPowerMode = hwc_setPowerMode;
     ctx->device.query = hwc_query;
     ctx->device.registerProcs = hwc_registerProcs;
     ctx->device.dump = hwc_dump;
     ctx->device.getDisplayConfigs = hwc_getDisplayConfigs;
     ctx->device.getDisplayAttributes = hwc_getDisplayAttributes;
+    ctx->device.getActiveConfig = hwc_getActiveConfig;
+    ctx->device.setActiveConfig = hwc_setActiveConfig;
+
+    if (pipe2 (ctx->wake_fds, O_CLOEXEC | O_NONBLOCK)
+        || pipe2 (ctx->done_fds, O_CLOEXEC | O_NONBLOCK)) {
+        ALOGE ("Failed to create event pipes: %s\n", strerror (errno));
+        return -errno;
+    }
 
-    ctx->drm_fd = -1;
+    property_get ("ro.hwc.idle.timeout_ms", prop_val, "0");
+    ctx->idle_timeout_ns = (int64_t) atoi (prop_val) * 1000000;
+    property_get ("ro.hwc.idle.modeset", prop_val, "0");
+    ctx->idle_modeset = atoi (prop_val) != 0;
+
+    property_get ("ro.hwc.latch.margin_us", prop_val, "");
+    ctx->latch_margin_ns = (int64_t) (prop_val[0] ? atoi (prop_val) :
+        LATCH_MARGIN_DEFAULT_US) * 1000;
 
     /* Open Gralloc module */
     ret = hw_get_module (GRALLOC_HARDWARE_MODULE_ID,
@@ -848,23 +4141,78 @@ hwc_device_open (const struct hw_module_t *module, const char *name,
         return ret;
     }
 
+    for (unsigned int i = 0; i < MAX_DRM_NODES; i++)
+        ctx->devices[i].fd = -1;
+    ctx->gralloc_fd = -1;
+
+    ret = open_drm_devices (ctx);
+    if (ret) {
+        for (unsigned int i = 0; i < ctx->num_devices; i++)
+            close_device (&ctx->devices[i]);
+        return -EINVAL;
+    }
+    ctx->probe_ns = now_ns () - ctx->open_ns;
+
     property_get("ro.disp.conn.primary", prop_val, "");
-    connector = hwc_get_connector (prop_val);
-    ret = init_display (ctx, HWC_DISPLAY_PRIMARY, connector);
+    conn_str = prop_val;
+    kdev = hwc_get_device (ctx, &conn_str);
+    connector = hwc_get_connector (conn_str);
+    ret = init_display (ctx, HWC_DISPLAY_PRIMARY, kdev, connector);
     if (ret) {
-        if (ctx->drm_fd != -1)
-            drmClose (ctx->drm_fd);
+        for (unsigned int i = 0; i < ctx->num_devices; i++)
+            close_device (&ctx->devices[i]);
         return -EINVAL;
     }
 
     property_get("ro.disp.conn.external", prop_val, "OFF");
-    connector = hwc_get_connector (prop_val);
+    conn_str = prop_val;
+    kdev = hwc_get_device (ctx, &conn_str);
+    connector = hwc_get_connector (conn_str);
     if (connector >= 0)
-        init_display (ctx, HWC_DISPLAY_EXTERNAL, connector);
+        init_display (ctx, HWC_DISPLAY_EXTERNAL, kdev, connector);
+
+    /* devices without display are closed, the others get their planes */
+    for (unsigned int i = 0; i < ctx->num_devices; i++) {
+        kms_device_t *dev = &ctx->devices[i];
+
+        if (!dev->used_crtcs) {
+            close_device (dev);
+            continue;
+        }
+        dev->used_planes = 0;
+        init_planes (dev);
+    }
+
+    property_get ("ro.hwc.render_scale.auto", prop_val, "0");
+    ctx->render_scale_auto = atoi (prop_val);
+    init_render_scale (ctx, HWC_DISPLAY_PRIMARY);
 
-    ctx->used_planes = 0;
+    /* no event thread yet, the startup color transform is applied here */
+    for (int disp = 0; disp < HWC_NUM_PHYSICAL_DISPLAY_TYPES; disp++) {
+        kms_display_t *d = &ctx->displays[disp];
+        kms_color_t color;
 
-    init_gralloc (ctx->drm_fd);
+        if (!d->dev)
+            continue;
+        color_identity (&d->color);
+        load_color_transform (disp, &color);
+        if ((!is_identity_matrix (color.matrix) || color.degamma
+                || color.gamma) && !apply_color_transform (ctx, disp, &color))
+            d->color = color;
+    }
+
+    property_get ("ro.hwc.static.frames", prop_val, "");
+    ctx->static_frames = prop_val[0] ? atoi (prop_val) : STATIC_FRAMES_DEFAULT;
+
+    property_get ("ro.hwc.plane.promote_frames", prop_val, "");
+    ctx->promote_frames =
+        prop_val[0] ? atoi (prop_val) : PROMOTE_FRAMES_DEFAULT;
+    property_get ("ro.hwc.plane.promote_percent", prop_val, "");
+    ctx->promote_percent =
+        prop_val[0] ? atoi (prop_val) : PROMOTE_PERCENT_DEFAULT;
+
+    /* buffers are allocated on the primary device and shared through PRIME */
+    init_gralloc (ctx, ctx->displays[HWC_DISPLAY_PRIMARY].dev);
 
     pthread_attr_t attrs;
     pthread_attr_init (&attrs);
@@ -876,6 +4224,17 @@ hwc_device_open (const struct hw_module_t *module, const char *name,
         return ret;
     }
 
+    /* the static layers cache is blended away from the event thread */
+    if (ctx->static_frames) {
+        if (pipe2 (ctx->cache_wake_fds, O_CLOEXEC)
+            || fcntl (ctx->cache_wake_fds[1], F_SETFL, O_NONBLOCK)
+            || pthread_create (&ctx->cache_thread, &attrs, cache_handler,
+                ctx)) {
+            ALOGE ("Failed to start the static cache thread, cache disabled");
+            ctx->static_frames = 0;
+        }
+    }
+
     *device = &ctx->device.common;
 
     return 0;
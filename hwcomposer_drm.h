@@ -1,7 +1,9 @@
 #ifndef ANDROID_HWC_H_
 #define ANDROID_HWC_H_
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <math.h>
 #include <poll.h>
 #include <pthread.h>
@@ -12,6 +14,7 @@
 #include <sys/mman.h>
 #include <sys/time.h>
 #include <sys/resource.h>
+#include <sys/stat.h>
 
 #include <cutils/compiler.h>
 #include <cutils/log.h>
@@ -36,9 +39,327 @@
 #define ARRAY_SIZE(arr) (sizeof(arr)/sizeof((arr)[0]))
 #endif
 
-#define FENCE_DELAY 2
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+/*
+ * Threads
+ *
+ * SurfaceFlinger calls into the HAL from its main thread while the event
+ * thread, running at urgent display priority, owns every KMS commit, the
+ * vblank handling and the fence timelines. The static layers cache is drawn
+ * by a thread of its own at normal priority. Nothing is shared under a lock:
+ * frames go through a single producer / single consumer ring, requests such
+ * as power changes through sequence numbers, and flags and counters are
+ * accessed with the atomics below.
+ */
+#define HWC_LOAD(p) __atomic_load_n (p, __ATOMIC_ACQUIRE)
+#define HWC_STORE(p, v) __atomic_store_n (p, v, __ATOMIC_RELEASE)
+
+/* frames waiting on the event thread to be latched, per display */
+#define MAX_QUEUED_FRAMES 3
+
+/* planes and client target committed for one frame */
+#define MAX_FRAME_LAYERS 16
+
+/* lower bound of the late latching margin */
+#define LATCH_MARGIN_DEFAULT_US 2000
+
+/* planes are tracked in the 64 bits used_planes mask */
+#define MAX_PLANES 64
+
+/*
+ * Tracing
+ *
+ * debug.hwc.trace is a mask of the categories below. Enabled trace points are
+ * written to the ftrace trace_marker in the atrace format, so they show up in
+ * systrace and perfetto, and with TRACE_RING also kept in memory for dump.
+ */
+#define TRACE_FRAME (1 << 0)    /* prepare, set, latch and commit */
+#define TRACE_KMS (1 << 1)      /* KMS ioctls */
+#define TRACE_FENCE (1 << 2)    /* fence waits and signaling */
+#define TRACE_IMPORT (1 << 3)   /* plane search and framebuffer import */
+#define TRACE_VBLANK (1 << 4)
+#define TRACE_LAYERS (1 << 5)   /* log the layers of each prepare */
+#define TRACE_RING (1 << 8)
+
+/* events kept for dump, a power of two */
+#define TRACE_RING_SIZE 256
+
+typedef struct kms_trace_event {
+    int64_t ts;
+    pid_t tid;
+    char phase;                 /* 'B'egin, 'E'nd or 'C'ounter */
+    char name[23];
+    int64_t value;              /* frame id, or counter value */
+} kms_trace_event_t;
+
+typedef struct kms_trace {
+    unsigned int mask;
+    int marker_fd;
+    pid_t pid;
+    kms_trace_event_t ring[TRACE_RING_SIZE];
+    unsigned int ring_pos;
+} kms_trace_t;
+
+#ifndef DRM_FORMAT_MOD_INVALID
+#define DRM_FORMAT_MOD_INVALID ((1ULL << 56) - 1)
+#endif
+#ifndef DRM_FORMAT_MOD_LINEAR
+#define DRM_FORMAT_MOD_LINEAR 0ULL
+#endif
+#ifndef DRM_MODE_FB_MODIFIERS
+#define DRM_MODE_FB_MODIFIERS (1 << 1)
+#endif
+#ifndef DRM_CAP_ADDFB2_MODIFIERS
+#define DRM_CAP_ADDFB2_MODIFIERS 0x10
+#endif
+
+typedef struct kms_format_mod {
+    uint32_t fourcc;
+    uint64_t modifier;
+} kms_format_mod_t;
+
+typedef struct kms_plane {
+    uint32_t plane_id;
+    uint32_t possible_crtcs;
+
+    /* format x modifier pairs accepted by the plane */
+    kms_format_mod_t *formats;
+    unsigned int count_formats;
+
+    /* failed a commit, left out until a display powers on */
+    bool rejected;
+} kms_plane_t;
+
+/* layers tracked across frames for the static layers cache */
+#define MAX_TRACKED_LAYERS 32
+
+/* frames a layer must stay unchanged before it is cached, 0 for no cache */
+#define STATIC_FRAMES_DEFAULT 0
+
+/* frames a layer must stay eligible for a plane before leaving the GPU */
+#define PROMOTE_FRAMES_DEFAULT 3
+
+/* share of the display a layer must cover to get a plane right away */
+#define PROMOTE_PERCENT_DEFAULT 50
+
+/*
+ * Render scaling: the primary display may report a smaller resolution to
+ * SurfaceFlinger, its client target being upscaled by the primary plane.
+ * The scale steps down when client composition takes more than
+ * RENDER_SCALE_DOWN_PERCENT of a frame for RENDER_SCALE_FRAMES frames, and
+ * up when the next step would stay under RENDER_SCALE_UP_PERCENT four times
+ * as long.
+ */
+#define RENDER_SCALE_DOWN_PERCENT 85
+#define RENDER_SCALE_UP_PERCENT 50
+#define RENDER_SCALE_FRAMES 300
+
+/* crtcs of a device, as in the possible_crtcs masks */
+#define MAX_CRTCS 32
+
+/* /dev/dri/card* nodes probed at startup and devices kept open */
+#define MAX_DRM_NODES 8
+
+/*
+ * Framebuffers of the gralloc buffers, kept per device until no display
+ * showed them for FB_CACHE_FRAMES frames. Each one holds a reference on the
+ * GEM handle of its dma-buf.
+ */
+#define MAX_CACHED_FBS 64
+#define FB_CACHE_FRAMES 120
+
+/* frames of the primary display between two checks of the fb accounting */
+#define RESOURCE_CHECK_FRAMES 3600
+
+typedef struct kms_fb {
+    ino_t ino;                  /* of the dma-buf, 0 for a free slot */
+    uint32_t fourcc;
+    uint32_t width;
+    uint32_t height;
+    uint64_t modifier;
+    uint32_t offset;            /* in the dma-buf */
+    uint32_t fb_id;
+    uint32_t handle;
+    unsigned last_frame;        /* device frame which last used it */
+    unsigned last_seq[HWC_NUM_PHYSICAL_DISPLAY_TYPES];  /* 0 when unused */
+} kms_fb_t;
+
+typedef struct kms_gem {
+    uint32_t handle;
+    unsigned int refs;          /* 0 for a free slot */
+} kms_gem_t;
+
+/*
+ * KMS objects of a device, fetched once at startup and shared by all the
+ * displays living on it.
+ */
+typedef struct kms_snapshot {
+    drmModeResPtr res;
+    drmModeConnectorPtr *connectors;
+    drmModeEncoderPtr *encoders;
+    drmModeCrtcPtr *crtcs;
+} kms_snapshot_t;
+
+/*
+ * A KMS device and the objects it owns. Displays are spread over the devices,
+ * each one with its own framebuffers and planes: buffers are imported into
+ * the device of the display showing them.
+ */
+typedef struct kms_device {
+    char path[32];
+    int fd;
+    kms_snapshot_t snap;
+    uint32_t used_crtcs;        /* crtcs driving a display */
+
+    /* drm planes management*/
+    kms_plane_t planes[MAX_PLANES];
+    unsigned int num_planes;
+    uint64_t used_planes;
+    bool fb_modifiers;
+
+    /* primary plane of each crtc, kept out of the overlays */
+    uint32_t primary_planes[MAX_CRTCS];
+
+    /* imported buffers, owned by the HAL thread */
+    bool shared_handles;        /* fd shared with gralloc */
+    kms_fb_t fbs[MAX_CACHED_FBS];
+    kms_gem_t gems[MAX_CACHED_FBS];
+    unsigned frames;
+    ino_t rejected_ino;         /* last dma-buf the import failed for */
+    unsigned int num_fbs;
+    unsigned int num_gems;
+    uint64_t fbs_created;
+    uint64_t fbs_removed;
+    uint64_t gems_opened;
+    uint64_t gems_closed;
+} kms_device_t;
+
+typedef struct kms_layer_sig {
+    buffer_handle_t handle;
+    hwc_rect_t displayFrame;
+    hwc_rect_t sourceCrop;
+    uint32_t transform;
+    int32_t blending;
+    uint8_t planeAlpha;
+} kms_layer_sig_t;
+
+/* plane given to a layer by prepare, 0 for GPU composition */
+typedef struct kms_layer_plane {
+    buffer_handle_t handle;
+    hwc_rect_t displayFrame;
+    uint32_t plane_id;
+    unsigned int eligible_frames;       /* held back from a plane */
+} kms_layer_plane_t;
+
+typedef struct kms_dumb {
+    uint32_t handle;
+    uint32_t fb_id;
+    uint32_t width;
+    uint32_t height;
+    uint32_t pitch;
+    uint64_t size;
+    void *map;
+} kms_dumb_t;
+
+/*
+ * Buffers of the static layers cache: one per queued frame, plus the ones
+ * on screen and pending a flip.
+ */
+#define STATIC_CACHE_BUFS (MAX_QUEUED_FRAMES + 2)
+
+/*
+ * A layer to blend into the cache, copied from hwc_set() since the buffer
+ * handle may be freed before the cache thread gets to it.
+ */
+typedef struct kms_static_src {
+    int fd;                     /* dup of the buffer share_fd */
+    int format;
+    int width;
+    int height;
+    uint32_t pitch;
+    uint32_t offset;
+    hwc_rect_t displayFrame;
+    hwc_rect_t sourceCrop;
+    int32_t blending;
+    uint8_t planeAlpha;
+} kms_static_src_t;
+
+typedef struct kms_static_buf {
+    kms_dumb_t dumb;
+    hwc_rect_t bbox;
+    kms_static_src_t srcs[MAX_TRACKED_LAYERS];
+    size_t count;
+    int fence;                  /* acquire fences of the sources, merged */
+    unsigned job_seq;           /* point of the cache timeline once drawn */
+    bool busy;                  /* cleared by the cache thread */
+    unsigned last_seq;          /* last frame scanning it out */
+} kms_static_buf_t;
+
+/*
+ * A group of adjacent layers which didn't change for a while, composited once
+ * by the HWC into its own buffer and scanned out from a single plane.
+ */
+typedef struct kms_static_cache {
+    kms_static_buf_t bufs[STATIC_CACHE_BUFS];
+    int front;
+    uint32_t plane_id;
+
+    /* group selected by the last prepare */
+    size_t first;
+    size_t count;
+    hwc_rect_t bbox;
+
+    /* layers the front buffer was built from */
+    kms_layer_sig_t built[MAX_TRACKED_LAYERS];
+    size_t num_built;
+
+    /* buffers to draw, queued by hwc_set() for the cache thread */
+    int jobs[STATIC_CACHE_BUFS];
+    unsigned job_head;
+    unsigned job_tail;
+    unsigned job_seq;
+
+    /* cache thread */
+    uint32_t *scratch;
+    size_t scratch_size;
+} kms_static_cache_t;
+
+/* color transform of a display, from the persist.hwc.color.* properties */
+typedef struct kms_color {
+    float matrix[16];           /* 4x4, applied to [R G B 1] row vectors */
+    float degamma;              /* transfer curve exponents, 0 for none */
+    float gamma;
+} kms_color_t;
+
+typedef struct kms_frame_layer {
+    int type;                   /* HWC_FRAMEBUFFER_TARGET or HWC_OVERLAY */
+    uint32_t fb_id;
+    uint32_t plane_id;
+    hwc_rect_t displayFrame;
+    hwc_rect_t sourceCrop;
+    int acquire_fence;
+} kms_frame_layer_t;
+
+/*
+ * Everything needed to commit a frame, captured from hwc_set() since the
+ * display contents don't outlive the call.
+ */
+typedef struct kms_frame {
+    unsigned seq;
+    int64_t prepare_ns;         /* client composition started after it */
+    kms_frame_layer_t layers[MAX_FRAME_LAYERS];
+    unsigned int num_layers;
+} kms_frame_t;
 
 typedef struct kms_display {
+    kms_device_t *dev;
+    int pipe;                   /* index of the crtc on its device */
     drmModeConnectorPtr con;
     drmModeEncoderPtr enc;
     drmModeCrtcPtr crtc;
@@ -50,20 +371,123 @@ typedef struct kms_display {
 
     /* sync */
     int timeline;
-    unsigned signaled_fences;
+    int cache_timeline;         /* static cache buffers drawn */
+    unsigned signaled_fences;   /* last frame seen on screen */
+    unsigned shown_seq;         /* last frame committed and seen on screen */
+    unsigned frame_seq;         /* last frame queued */
+
+    /* late latching, hwc_set() owns queue_tail and the event thread owns
+     * queue_head */
+    kms_frame_t queue[MAX_QUEUED_FRAMES];
+    unsigned queue_head;
+    unsigned queue_tail;
+    int64_t vsync_period_ns;
+    int64_t last_vblank_ns;
+    int64_t latch_margin_ns;
+    int64_t commit_ewma_ns;
+    int64_t miss_penalty_ns;
+
+    /* last commit, waiting for a vblank or its page flip event to reach the
+     * screen */
+    unsigned pending_seq;
+    int64_t pending_commit_ns;
+    int64_t pending_target_ns;
+    int64_t pending_duration_ns;
+    bool flip_pending;
+    int64_t last_commit_ns;
+    uint32_t crtc_fb;
+    drmModeModeInfoPtr crtc_set_mode;   /* mode the crtc was set with */
+    uint32_t target_fb;
+
+    /* render resolution, smaller than the mode when the client target is
+     * upscaled by the primary plane */
+    int32_t width;
+    int32_t height;
+    int render_scale;           /* percent */
+    int render_scale_next;      /* picked for the next start */
+    int render_scale_saved;     /* in persist.hwc.render_scale */
+    uint32_t primary_plane_id;
+    kms_dumb_t modeset_fb;
+    int64_t prepare_ns;
+    int64_t client_ewma_ns;
+    unsigned int scale_over;
+    unsigned int scale_under;
+
+    /* idle refresh rate: a slower mode or variable refresh on the crtc */
+    drmModeModeInfoPtr idle_mode;
+    uint32_t vrr_prop_id;
+    bool idle;
+    int64_t idle_retry_ns;      /* last attempt to enter it */
+
+    /* power, the last committed frame is restored on power on */
+    int power_mode;
+    int power_req;
+    unsigned power_req_seq;
+    unsigned power_done_seq;
+    int power_ret;
+    uint32_t dpms_prop_id;
+    bool vblank_armed;
+    kms_frame_t committed;
+    int64_t power_on_ns;
+    int64_t screen_on_ns;
+
+    /* crtc color pipeline, 0 when a stage doesn't exist */
+    uint32_t ctm_prop_id;
+    uint32_t degamma_prop_id;
+    uint32_t gamma_prop_id;
+    uint32_t degamma_size;
+    uint32_t gamma_size;
+    uint32_t color_blobs[3];    /* CTM, DEGAMMA_LUT and GAMMA_LUT in use */
+    kms_color_t color;
+    kms_color_t color_req;
+    unsigned color_req_seq;
+    unsigned color_done_seq;
+    int color_ret;
+
+    /* static layers detection */
+    kms_layer_sig_t sigs[MAX_TRACKED_LAYERS];
+    unsigned int static_frames[MAX_TRACKED_LAYERS];
+    size_t num_sigs;
+    kms_static_cache_t cache;
+
+    /* planes scanning out something for this display */
+    uint64_t active_planes;
+
+    /* plane assignment of the last prepare, by layer index */
+    kms_layer_plane_t assigned[MAX_TRACKED_LAYERS];
+    size_t num_assigned;
 } kms_display_t;
 
 typedef struct hwc_context {
     hwc_composer_device_1_t device;
-    pthread_mutex_t ctx_mutex;
     const hwc_procs_t *cb_procs;
 
     const struct gralloc_module_t *gralloc;
 
-    int drm_fd;
+    kms_device_t devices[MAX_DRM_NODES];
+    unsigned int num_devices;
     kms_display_t displays[HWC_NUM_DISPLAY_TYPES];
 
     pthread_t event_thread;
+    int wake_fds[2];            /* to the event thread */
+    int done_fds[2];            /* back from the event thread */
+
+    pthread_t cache_thread;
+    int cache_wake_fds[2];      /* to the static cache thread */
+
+    /* 0 commits frames as soon as they are ready */
+    int64_t latch_margin_ns;
+
+    /* 0 keeps the displays at full refresh rate */
+    int64_t idle_timeout_ns;
+
+    /* without variable refresh, modeset to a slower mode while idle */
+    bool idle_modeset;
+
+    /* startup timing */
+    int64_t open_ns;
+    int64_t probe_ns;
+    int64_t first_frame_ns;
 
     int32_t xres;
     int32_t yres;
@@ -71,8 +495,21 @@ typedef struct hwc_context {
     int32_t ydpi;
     int32_t vsync_period;
 
-    /* drm planes management*/
-    uint64_t used_planes;
+    /* 0 disables the static layers cache */
+    unsigned int static_frames;
+
+    /* pick the render scale of the next start from client composition time */
+    bool render_scale_auto;
+
+    /* plane assignment hysteresis */
+    unsigned int promote_frames;
+    unsigned int promote_percent;
+
+    /* primary device file handed to gralloc */
+    int gralloc_fd;
+
+    /* highest count of open fds seen by the resource check */
+    int fds_high;
 } hwc_context_t;
 
 #endif //#ifndef ANDROID_HWC_H_
@@ -0,0 +1,37 @@
+# Copyright (C) 2008 The Android Open Source Project
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+
+LOCAL_PATH := $(call my-dir)
+
+# soak test of the framebuffer cache and release fences, run on the device:
+# hwc_soak [/dev/dri/cardN] [frames]
+include $(CLEAR_VARS)
+
+LOCAL_SHARED_LIBRARIES := liblog libdrm libhardware libsync
+LOCAL_SRC_FILES := hwc_soak.cpp
+LOCAL_MODULE := hwc_soak
+LOCAL_CFLAGS:= -DLOG_TAG=\"hwc_soak\"
+ifeq ($(BOARD_GRALLOC_HAS_MODIFIER),true)
+LOCAL_CFLAGS += -DGRALLOC_HAS_MODIFIER
+endif
+LOCAL_MODULE_TAGS := tests
+LOCAL_C_INCLUDES += \
+        $(TOP)/hardware/libhardware/modules/gralloc \
+        $(TOP)/external/drm \
+        $(TOP)/external/drm/include/drm \
+        $(TOP)/hardware/libhardware/include \
+        $(TOP)/system/core/libsync
+
+include $(BUILD_EXECUTABLE)
@@ -0,0 +1,192 @@
+/*
+ * Soak test of the framebuffer cache and the release fences
+ *
+ * Runs a buffer queue through get_buffer_fb() and set_release_fences() on a
+ * real DRM device for many frames, the way a long uptime does, reallocating
+ * its buffers every few frames like an app resizing or restarting. Once the
+ * framebuffer cache reached its steady state, the open fds, framebuffers and
+ * GEM handles must stay flat from one reallocation to the next, and go back
+ * to where they started once the cache is destroyed.
+ *
+ * usage: hwc_soak [/dev/dri/cardN] [frames]
+ */
+#include "../hwcomposer.cpp"
+
+/* buffers of the queue, reallocated every SOAK_REALLOC_FRAMES frames */
+#define SOAK_BUFFERS 3
+#define SOAK_REALLOC_FRAMES 40
+#define SOAK_WIDTH 256
+#define SOAK_HEIGHT 256
+
+/* frames before the cache is full of expiring framebuffers */
+#define SOAK_WARMUP_FRAMES (4 * FB_CACHE_FRAMES)
+
+#define SOAK_CHECK(cond, ...) do {                                      \
+        if (!(cond)) {                                                  \
+            fprintf (stderr, "hwc_soak: frame %u: ", frame);            \
+            fprintf (stderr, __VA_ARGS__);                              \
+            fprintf (stderr, "\n");                                     \
+            return 1;                                                   \
+        }                                                               \
+    } while (0)
+
+/* a dma-buf backed by a dumb buffer, owned by the dma-buf only */
+static int
+alloc_soak_buffer (int drm_fd, private_handle_t * hnd)
+{
+    struct drm_mode_create_dumb create;
+    struct drm_gem_close req;
+    int ret;
+
+    memset (&create, 0, sizeof (create));
+    create.width = SOAK_WIDTH;
+    create.height = SOAK_HEIGHT;
+    create.bpp = 32;
+    if (drmIoctl (drm_fd, DRM_IOCTL_MODE_CREATE_DUMB, &create))
+        return -errno;
+
+    memset (hnd, 0, sizeof (*hnd));
+    ret = drmPrimeHandleToFD (drm_fd, create.handle, DRM_CLOEXEC,
+        &hnd->share_fd);
+
+    memset (&req, 0, sizeof (req));
+    req.handle = create.handle;
+    drmIoctl (drm_fd, DRM_IOCTL_GEM_CLOSE, &req);
+    if (ret)
+        return ret;
+
+    hnd->format = HAL_PIXEL_FORMAT_RGBA_8888;
+    hnd->width = SOAK_WIDTH;
+    hnd->height = SOAK_HEIGHT;
+    hnd->stride = create.pitch / 4;
+    hnd->size = create.size;
+    return 0;
+}
+
+int
+main (int argc, char **argv)
+{
+    const char *path = argc > 1 ? argv[1] : "/dev/dri/card0";
+    unsigned frames = argc > 2 ? strtoul (argv[2], NULL, 0) : 100000;
+    hwc_context_t *ctx;
+    kms_device_t *dev;
+    kms_display_t *kdisp;
+    hwc_display_contents_1_t *display;
+    private_handle_t *bufs;
+    int fds_start, fds_ref = -1, fds_high = 0;
+    unsigned fbs_ref = 0, gems_ref = 0;
+    unsigned frame = 0;
+
+    ctx = (hwc_context_t *) calloc (1, sizeof (*ctx));
+    bufs = (private_handle_t *) calloc (SOAK_BUFFERS, sizeof (*bufs));
+    display = (hwc_display_contents_1_t *) calloc (1,
+        sizeof (*display) + 2 * sizeof (hwc_layer_1_t));
+    if (!ctx || !bufs || !display)
+        return 1;
+
+    dev = &ctx->devices[0];
+    ctx->num_devices = 1;
+    snprintf (dev->path, sizeof (dev->path), "%s", path);
+    dev->fd = open (path, O_RDWR | O_CLOEXEC);
+    SOAK_CHECK (dev->fd >= 0, "cannot open %s: %s", path, strerror (errno));
+
+    kdisp = &ctx->displays[HWC_DISPLAY_PRIMARY];
+    kdisp->dev = dev;
+    kdisp->ctx = ctx;
+    kdisp->timeline = sw_sync_timeline_create ();
+    SOAK_CHECK (kdisp->timeline >= 0, "no sw_sync timeline: %s",
+        strerror (errno));
+
+    fds_start = count_fds ();
+
+    /* an overlay over the client target, both released by the next frame */
+    display->numHwLayers = 2;
+    display->hwLayers[0].compositionType = HWC_OVERLAY;
+    display->hwLayers[1].compositionType = HWC_FRAMEBUFFER_TARGET;
+
+    for (frame = 0; frame < frames; frame++) {
+        private_handle_t *hnd = &bufs[frame % SOAK_BUFFERS];
+        unsigned seq;
+        uint32_t fb;
+
+        if (frame % SOAK_REALLOC_FRAMES == 0) {
+            /* the same phase of every cycle sees the same cache */
+            if (frame >= SOAK_WARMUP_FRAMES) {
+                int fds = count_fds ();
+
+                if (fds_ref < 0) {
+                    fds_ref = fds;
+                    fbs_ref = dev->num_fbs;
+                    gems_ref = dev->num_gems;
+                }
+                SOAK_CHECK (fds == fds_ref, "%d fds, %d before", fds,
+                    fds_ref);
+                SOAK_CHECK (dev->num_fbs == fbs_ref, "%u fbs, %u before",
+                    dev->num_fbs, fbs_ref);
+                SOAK_CHECK (dev->num_gems == gems_ref,
+                    "%u GEM handles, %u before", dev->num_gems, gems_ref);
+            }
+
+            for (int i = 0; i < SOAK_BUFFERS; i++) {
+                if (frame)
+                    close (bufs[i].share_fd);
+                SOAK_CHECK (!alloc_soak_buffer (dev->fd, &bufs[i]),
+                    "cannot allocate a buffer: %s", strerror (errno));
+            }
+        }
+
+        /* update_display() of a single buffer frame */
+        dev->frames++;
+        SOAK_CHECK (!get_buffer_fb (ctx, HWC_DISPLAY_PRIMARY, hnd, &fb),
+            "cannot import the buffer: %s", strerror (errno));
+        seq = ++kdisp->frame_seq;
+        display->hwLayers[0].handle = hnd;
+        display->hwLayers[1].handle = hnd;
+        set_release_fences (ctx, HWC_DISPLAY_PRIMARY, display, seq);
+
+        /* SurfaceFlinger owns the fences, the frame reaches the screen */
+        for (int i = 0; i < 2; i++) {
+            SOAK_CHECK (display->hwLayers[i].releaseFenceFd >= 0,
+                "no release fence");
+            close (display->hwLayers[i].releaseFenceFd);
+            display->hwLayers[i].releaseFenceFd = -1;
+        }
+        SOAK_CHECK (display->retireFenceFd >= 0, "no retire fence");
+        close (display->retireFenceFd);
+        display->retireFenceFd = -1;
+
+        HWC_STORE (&kdisp->shown_seq, seq);
+        signal_fences (ctx, HWC_DISPLAY_PRIMARY, seq);
+        expire_fbs (ctx, dev);
+
+        SOAK_CHECK (dev->fbs_created - dev->fbs_removed == dev->num_fbs
+            && dev->gems_opened - dev->gems_closed == dev->num_gems
+            && dev->num_gems <= dev->num_fbs, "%u fbs and %u GEM handles "
+            "accounted, %llu/%llu fbs and %llu/%llu handles opened/closed",
+            dev->num_fbs, dev->num_gems,
+            (unsigned long long) dev->fbs_created,
+            (unsigned long long) dev->fbs_removed,
+            (unsigned long long) dev->gems_opened,
+            (unsigned long long) dev->gems_closed);
+        fds_high = MAX (fds_high, count_fds ());
+    }
+
+    for (int i = 0; i < SOAK_BUFFERS && frames; i++)
+        close (bufs[i].share_fd);
+    destroy_fbs (dev);
+
+    SOAK_CHECK (!dev->num_fbs && !dev->num_gems,
+        "%u fbs and %u GEM handles left", dev->num_fbs, dev->num_gems);
+    SOAK_CHECK (count_fds () == fds_start, "%d fds left, %d at start",
+        count_fds (), fds_start);
+
+    printf ("hwc_soak: %u frames, %llu fbs created, up to %d fds\n", frames,
+        (unsigned long long) dev->fbs_created, fds_high);
+
+    close (kdisp->timeline);
+    close (dev->fd);
+    free (display);
+    free (bufs);
+    free (ctx);
+    return 0;
+}